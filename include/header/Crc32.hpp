@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * CRC-32 (IEEE 802.3, the one of zip and png) used to check the integrity of the data files.
+ * Crc32(data, size) computes the checksum of a buffer, and Crc32(data, size, crc) continues
+ * the checksum of a previous buffer, so that a file can be checked in several pieces.
+ */
+inline uint32_t Crc32(const void *data, size_t size, uint32_t crc = 0)
+{
+    struct Table
+    {
+        uint32_t t[256];
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+        }
+    };
+    static const Table table;
+
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table.t[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+// Key of a book record (OpeningBook::Record(): 56 bits key, 8 bits value)
+struct BookRecordKey
+{
+    uint64_t operator()(const uint64_t record) const
+    {
+        return record & ((UINT64_C(1) << 56) - 1);
+    }
+};
+
+/**
+ * Sorts any number of records by key in bounded memory and removes the duplicated keys, keeping the record added last.
+ * The records are gathered in a buffer; each time it is full it is sorted and written to a temporary file (a run),
+ * and Finish() merges the runs. The memory used is about the given budget whatever the number of records.
+ * @param: Record, a trivially copyable type (written as is to the runs), by default a book record
+ * @param: KeyOf, the function object giving the uint64_t key of a record
+ */
+template <class Record = uint64_t, class KeyOf = BookRecordKey>
+class ExternalSorter
+{
+public:
+    /**
+     * @param: tmp_prefix, path prefix of the temporary run files (e.g. "data/book"), they are removed by Finish()
+     * @param: memory_bytes, memory budget of the buffer (and of the merge buffers)
+     */
+    ExternalSorter(std::string tmp_prefix, const size_t memory_bytes)
+        : prefix(std::move(tmp_prefix)), budget(std::max<size_t>(memory_bytes / sizeof(Record), MIN_BUFFER))
+    {
+        buffer.reserve(budget);
+    }
+
+    ~ExternalSorter()
+    {
+        for (const std::string &run : runs)
+            std::remove(run.c_str());
+    }
+
+    void Add(const Record &record)
+    {
+        buffer.push_back(record);
+        added++;
+        if (buffer.size() == budget)
+            WriteRun();
+    }
+
+    uint64_t GetAdded() const
+    {
+        return added;
+    }
+
+    size_t GetRuns() const
+    {
+        return runs.size();
+    }
+
+    /**
+     * Call f(record) for each distinct key in increasing key order.
+     * @return false if a run file could not be written or read back
+     */
+    template <class F>
+    bool Finish(F f)
+    {
+        if (runs.empty()) // everything fitted in memory
+        {
+            SortUnique(buffer);
+            for (const Record &record : buffer)
+                f(record);
+            buffer.clear();
+            return ok;
+        }
+        if (!buffer.empty())
+            WriteRun();
+        std::vector<Record>().swap(buffer);
+        if (!ok)
+            return false;
+
+        // k-way merge, a key present in several runs keeps the record of the last run
+        const KeyOf keyOf;
+        const size_t chunk = std::max<size_t>(budget / (runs.size() + 1), MIN_BUFFER / 16);
+        std::vector<std::unique_ptr<RunReader>> readers;
+        for (const std::string &run : runs)
+            readers.push_back(std::make_unique<RunReader>(run, chunk));
+
+        using Head = std::pair<uint64_t, size_t>; // (key, run)
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+        for (size_t r = 0; r < readers.size(); r++)
+            if (readers[r]->Valid())
+                heads.push({keyOf(readers[r]->Get()), r});
+
+        while (!heads.empty())
+        {
+            const uint64_t key = heads.top().first;
+            Record record{};
+            while (!heads.empty() && heads.top().first == key)
+            {
+                const size_t r = heads.top().second; // runs of the same key come out in increasing order
+                heads.pop();
+                record = readers[r]->Get();
+                if (readers[r]->Next())
+                    heads.push({keyOf(readers[r]->Get()), r});
+            }
+            f(record);
+        }
+
+        for (const auto &reader : readers)
+            ok = ok && !reader->Failed();
+        for (const std::string &run : runs)
+            std::remove(run.c_str());
+        runs.clear();
+        return ok;
+    }
+
+private:
+    static constexpr size_t MIN_BUFFER = 1 << 16;
+
+    std::string prefix;
+    size_t budget; // records in memory
+    std::vector<Record> buffer;
+    std::vector<std::string> runs;
+    uint64_t added = 0;
+    bool ok = true;
+
+    // sort by key, keeping only the last record added of each key
+    static void SortUnique(std::vector<Record> &records)
+    {
+        const KeyOf keyOf;
+        std::stable_sort(records.begin(), records.end(), [&](const Record &a, const Record &b)
+                         { return keyOf(a) < keyOf(b); });
+        size_t out = 0;
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            if (i + 1 < records.size() && keyOf(records[i + 1]) == keyOf(records[i]))
+                continue;
+            records[out++] = records[i];
+        }
+        records.resize(out);
+    }
+
+    void WriteRun()
+    {
+        SortUnique(buffer);
+        const std::string name = prefix + ".run" + std::to_string(runs.size()) + ".tmp";
+        std::ofstream ofs(name, std::ios::binary);
+        ofs.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * sizeof(Record));
+        ofs.close();
+        if (!ofs)
+        {
+            std::cerr << "Error: Can't write file " << name << "\n";
+            ok = false;
+        }
+        runs.push_back(name);
+        buffer.clear();
+    }
+
+    // buffered sequential reader of a run file
+    class RunReader
+    {
+    public:
+        RunReader(const std::string &name, const size_t chunk) : ifs(name, std::ios::binary), data(chunk)
+        {
+            failed = !ifs;
+            Fill();
+        }
+
+        bool Valid() const
+        {
+            return pos < size;
+        }
+
+        const Record &Get() const
+        {
+            return data[pos];
+        }
+
+        bool Next()
+        {
+            if (++pos == size)
+                Fill();
+            return Valid();
+        }
+
+        bool Failed() const
+        {
+            return failed;
+        }
+
+    private:
+        std::ifstream ifs;
+        std::vector<Record> data;
+        size_t pos = 0;
+        size_t size = 0;
+        bool failed = false;
+
+        void Fill()
+        {
+            pos = 0;
+            ifs.read(reinterpret_cast<char *>(data.data()), data.size() * sizeof(Record));
+            size = ifs.gcount() / sizeof(Record);
+            if (ifs.bad())
+                failed = true;
+        }
+    };
+};
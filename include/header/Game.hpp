@@ -65,8 +65,9 @@ private:
     }
 
 public:
-    Game()
+    explicit Game(const SolveDriver driver = SolveDriver::Mtdf)
     {
+        solver.SetDriver(driver);
         solver.GetReady();
     }
 
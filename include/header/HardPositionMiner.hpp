@@ -0,0 +1,162 @@
+#pragma once
+
+#include "Solver.hpp"
+#include "Position.hpp"
+#include "SearchThrottle.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+/**
+ * Solves, in the background of the server, the positions whose search was hard, together with all their children.
+ * The exact scores go to the knowledge store shared with the server's solver (and to its journal when one is open),
+ * so the next time the same position (or a transposition of it) comes up it is answered from memory.
+ *
+ * The workers run at the lowest OS priority, use at most a share of a core each, and are paused while the server
+ * answers a request (see PauseGuard).
+ */
+class HardPositionMiner
+{
+public:
+    struct Options
+    {
+        unsigned int threads = 1;                  // 0 disables the miner
+        double cpu_share = 0.5;                    // fraction of a core each worker may use
+        double min_ms = 2000;                      // a search is hard if it took at least this time...
+        unsigned long long min_nodes = 50000000;   // ...or this number of nodes
+    };
+
+    // Pauses the miner for the lifetime of the guard
+    class PauseGuard
+    {
+    public:
+        explicit PauseGuard(HardPositionMiner &miner) : miner(miner)
+        {
+            miner.throttle.Pause();
+        }
+
+        ~PauseGuard()
+        {
+            miner.throttle.Resume();
+        }
+
+    private:
+        HardPositionMiner &miner;
+    };
+
+    HardPositionMiner(const Solver &solver, const Options &options) : options(options), throttle(options.cpu_share)
+    {
+        for (unsigned int t = 0; t < options.threads; ++t)
+        {
+            workers.push_back(solver.Fork());
+            workers.back()->SetThrottle(&throttle);
+            threads.emplace_back(&HardPositionMiner::Run, this, std::ref(*workers.back()));
+        }
+    }
+
+    ~HardPositionMiner()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        throttle.Stop();
+        for (std::thread &t : threads)
+            t.join();
+    }
+
+    /**
+     * Queue a position for mining if its search was hard (and it was not queued before).
+     * Boards with hidden cells are never queued, the knowledge store does not keep their scores.
+     * @return true if the position was queued
+     */
+    bool Submit(const Position &P, const double ms, const unsigned long long nodes)
+    {
+        if (workers.empty() || P.GetBlockedMask() || (ms < options.min_ms && nodes < options.min_nodes))
+            return false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!submitted.insert(P.Key3()).second)
+                return false;
+            queue.push_back(P);
+        }
+        cv.notify_one();
+        return true;
+    }
+
+private:
+    const Options options;
+    SearchThrottle throttle;
+    std::vector<std::unique_ptr<Solver>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Position> queue;
+    std::unordered_set<uint64_t> submitted;
+    bool stopping = false;
+
+    void Run(Solver &solver)
+    {
+#ifdef __linux__
+        setpriority(PRIO_PROCESS, 0, 19); // on Linux this only lowers the priority of the calling thread
+#endif
+        while (true)
+        {
+            Position P;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]
+                        { return stopping || !queue.empty(); });
+                if (stopping)
+                    return;
+                P = queue.front();
+                queue.pop_front();
+            }
+
+            try
+            {
+                Mine(solver, P);
+            }
+            catch (const SearchThrottle::Stopped &)
+            {
+                return;
+            }
+        }
+    }
+
+    void Mine(Solver &solver, const Position &P)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<Position> children;
+        for (int col = 0; col < Position::WIDTH; ++col)
+        {
+            if (P.CanPlay(col) && !P.IsWinningMove(col))
+            {
+                Position child(P);
+                child.PlayCol(col);
+                children.push_back(child);
+            }
+        }
+        solver.SolveBatch(children);
+        unsigned long long nodes = solver.GetLastStats().nodes;
+        const int score = solver.Solve(P);
+        nodes += solver.GetLastStats().nodes;
+
+        const std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        std::cout << "[Miner] Solved a position of " << P.nbMoves() << " moves (score " << score << ") and its "
+                  << children.size() << " children: " << nodes << " nodes, " << duration.count() << " s.\n";
+        std::cout.flush();
+    }
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+/**
+ * Set of position keys (Key3) that several threads can fill at the same time, e.g. the positions already visited
+ * by an enumeration. The keys are stored in a single open-addressed array of 8 bytes slots (linear probing, 0 marks
+ * an empty slot), allocated once: the capacity must be known in advance, Insert() throws std::overflow_error when
+ * the set is 15/16 full.
+ */
+class KeySet
+{
+public:
+    // min_size: number of keys the set must be able to hold
+    explicit KeySet(const size_t min_size)
+    {
+        size_t capacity = 1024;
+        while (capacity - capacity / 4 < min_size) // keeps the load under 3/4, probes stay short
+            capacity *= 2;
+        slots = std::make_unique<std::atomic<uint64_t>[]>(capacity);
+        for (size_t i = 0; i < capacity; i++)
+            slots[i].store(0, std::memory_order_relaxed);
+        mask = capacity - 1;
+    }
+
+    // Add a key, returns false if it was already in the set
+    bool Insert(const uint64_t key)
+    {
+        const uint64_t stored = key + 1;
+        for (size_t i = Hash(key) & mask;; i = (i + 1) & mask)
+        {
+            uint64_t slot = slots[i].load(std::memory_order_relaxed);
+            if (slot == 0)
+            {
+                if (size.load(std::memory_order_relaxed) >= mask - mask / 16)
+                    throw std::overflow_error("KeySet is full");
+                if (slots[i].compare_exchange_strong(slot, stored, std::memory_order_relaxed))
+                {
+                    size.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            if (slot == stored)
+                return false;
+        }
+    }
+
+    size_t GetSize() const
+    {
+        return size.load();
+    }
+
+    size_t GetCapacity() const
+    {
+        return mask + 1;
+    }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    size_t mask;
+    std::atomic<size_t> size{0};
+
+    static uint64_t Hash(const uint64_t key)
+    {
+        return (key * UINT64_C(0x9E3779B97F4A7C15)) >> 20; // the keys of close positions are close too
+    }
+};
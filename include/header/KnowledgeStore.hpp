@@ -0,0 +1,339 @@
+#pragma once
+
+#include "Position.hpp"
+#include "OpeningBook.hpp"
+#include "TranspositionTable.hpp"
+#include "SolveJournal.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <cstdlib>
+#include <filesystem>
+
+/**
+ * Exact scores known before searching, kept apart from the transposition table so that the search can
+ * neither overwrite them nor take their slots. The sources are consulted in priority order:
+ * - BOOK: the opening book, memory-mapped (see OpeningBook)
+ * - WARMUP: the scores of the hard positions found by training, from data/warmup.bin (a book file, mapped like
+ *   the opening book) or from the text file data/warmup.book when the binary file is missing or older
+ * - LEARNED: the scores of the positions solved since the start, in a small table of their own, and those of
+ *   previous runs when a journal is open (see SolveJournal)
+ *
+ * Each source only answers for positions of at most its number of moves, and counts its lookups and hits
+ * so that it can be seen which data actually saves search time. The search counts its own lookups in Counters of
+ * its solver, merged into the totals at the end of a solve, so that the threads sharing the store do not all
+ * write to the same counters at every node.
+ * Values are stored as in the table: score - MIN_SCORE + 1, and 0 means unknown.
+ * Positions are keyed by Key3(), as in the book. The learned table and the journal only keep keys of 56 bits
+ * (positions of less than about 30 moves), deeper positions are neither learned nor looked up there.
+ */
+class KnowledgeStore
+{
+public:
+	enum Source
+	{
+		BOOK,
+		WARMUP,
+		LEARNED,
+		SOURCES
+	};
+
+	struct SourceStats
+	{
+		size_t size;
+		unsigned long long lookups;
+		unsigned long long hits;
+	};
+
+	// Lookups and hits of each source, counted by a single solver
+	struct Counters
+	{
+		unsigned long long lookups[SOURCES] = {};
+		unsigned long long hits[SOURCES] = {};
+	};
+
+	// The search only looks for the learned scores of positions of at most this number of moves: deeper ones are
+	// quick to search again, and the learned depth grows to the deepest position ever solved
+	static constexpr int LEARNED_SEARCH_DEPTH = 24;
+
+	// Exact value of a position (score - MIN_SCORE + 1), 0 if no source knows it
+	uint8_t Get(const uint64_t key, const int nb_moves) const
+	{
+		Counters counters;
+		const uint8_t val = Lookup(key, nb_moves, learnedDepth.load(std::memory_order_relaxed), counters);
+		Merge(counters);
+		return val;
+	}
+
+	// Get() for a node of the search: counted in the counters of the solver, learned scores only up to LEARNED_SEARCH_DEPTH
+	uint8_t Probe(const uint64_t key, const int nb_moves, Counters &counters) const
+	{
+		return Lookup(key, nb_moves, std::min(LEARNED_SEARCH_DEPTH, learnedDepth.load(std::memory_order_relaxed)), counters);
+	}
+
+	// Add the counts of a solver to the totals of GetStats(), and reset them
+	void Merge(Counters &counters) const
+	{
+		for (int s = 0; s < SOURCES; s++)
+		{
+			if (counters.lookups[s])
+				lookups[s].fetch_add(counters.lookups[s], std::memory_order_relaxed);
+			if (counters.hits[s])
+				hits[s].fetch_add(counters.hits[s], std::memory_order_relaxed);
+		}
+		counters = Counters();
+	}
+
+	/**
+	 * Remember the exact score of a solved position (ignored once the learned table is 3/4 full, or if its key
+	 * does not fit in 56 bits).
+	 * @param: nodes, the cost of the solve, the position is also appended to the journal if it took at least
+	 * the minimum number of nodes given to OpenJournal()
+	 */
+	void Learn(const uint64_t key, const int nb_moves, const int score, const unsigned long long nodes = 0)
+	{
+		if (key > KEY_MASK)
+			return;
+		if (journal && nodes >= journalMinNodes && learned.Get(key) == 0)
+			journal->Append(OpeningBook::Record(key, uint8_t(score - Position::MIN_SCORE + 1)), nb_moves);
+		LearnValue(key, nb_moves, uint8_t(score - Position::MIN_SCORE + 1));
+	}
+
+	/**
+	 * Load the scores of a journal in the learned source, and append to it the positions solved from now on.
+	 * The entries are loaded at once with TranspositionTable::PutBatch(), the last one of a position wins as in Learn().
+	 * @param: min_nodes, only the solves of at least this number of nodes are worth a journal entry
+	 * @return the number of journal entries read
+	 */
+	size_t OpenJournal(const std::string &filename, const unsigned long long min_nodes)
+	{
+		// as in LearnValue(), the table is not filled past 3/4, the entries left out are only kept in the journal
+		const size_t room = learned.GetSize() / 4 * 3 - std::min(learned.GetSize() / 4 * 3, learnedCount.load());
+		std::vector<std::pair<uint64_t, uint8_t>> entries;
+		int depth = -1;
+		size_t count = 0;
+		journal = std::make_unique<SolveJournal>();
+		journalMinNodes = min_nodes;
+		journal->Open(filename, [&](uint64_t record, int nb_moves)
+					  {
+						  if (entries.size() < room)
+						  {
+							  entries.emplace_back(record & KEY_MASK, uint8_t(record >> 56));
+							  depth = std::max(depth, nb_moves);
+						  }
+						  count++; });
+
+		learnedCount += learned.PutBatch(entries, std::max(1u, std::thread::hardware_concurrency()));
+		int learned_depth = learnedDepth.load(std::memory_order_relaxed);
+		while (learned_depth < depth && !learnedDepth.compare_exchange_weak(learned_depth, depth, std::memory_order_relaxed))
+			;
+		return count;
+	}
+
+	bool LoadBook(const std::string &filename)
+	{
+		return book.load(filename);
+	}
+
+	/**
+	 * Load the warmup scores from the binary file, or from the text file if it is newer.
+	 * @return the number of positions loaded
+	 */
+	size_t LoadWarmup(const std::string &text_file, const std::string &binary_file)
+	{
+		std::error_code error;
+		const bool binary = std::filesystem::exists(binary_file, error);
+		const bool text = std::filesystem::exists(text_file, error);
+		if (binary && (!text || std::filesystem::last_write_time(binary_file, error) >=
+									std::filesystem::last_write_time(text_file, error)))
+		{
+			if (warmup.load(binary_file))
+				return warmup.GetSize();
+		}
+
+		std::vector<uint64_t> records;
+		int depth;
+		ParseWarmup(text_file, records, depth);
+		warmup.assign(std::move(records), depth);
+		if (text)
+			std::cout << "Warmup read from " << text_file << ", convert it to " << binary_file
+					  << " to load it faster (generator warmup)\n";
+		return warmup.GetSize();
+	}
+
+	/**
+	 * Read a warmup text file, one position per line: <moves> <score>. Invalid lines are skipped.
+	 * @param: records, filled with the positions packed with OpeningBook::Record(), in file order
+	 * @param: depth, set to the maximum number of moves of the positions (-1 if there is none)
+	 * @param: threads, number of threads parsing the file, 0 for one per core
+	 */
+	static void ParseWarmup(const std::string &filename, std::vector<uint64_t> &records, int &depth, unsigned int threads = 0)
+	{
+		records.clear();
+		depth = -1;
+		std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+		if (!ifs)
+			return;
+		std::string text(static_cast<size_t>(ifs.tellg()), '\0');
+		ifs.seekg(0);
+		ifs.read(&text[0], text.size());
+
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		threads = std::max<size_t>(1, std::min<size_t>(threads, text.size() / 65536));
+
+		// each thread parses the lines starting in its share of the text
+		std::vector<std::vector<uint64_t>> parts(threads);
+		std::vector<int> depths(threads, -1);
+		auto parse = [&](const unsigned int t)
+		{
+			size_t pos = text.size() * t / threads;
+			const size_t end = text.size() * (t + 1) / threads;
+			if (t > 0) // the line cut by the start of the share belongs to the previous one
+				pos = std::min(text.find('\n', pos - 1), text.size() - 1) + 1;
+			while (pos < end)
+			{
+				size_t eol = text.find('\n', pos);
+				if (eol == std::string::npos)
+					eol = text.size();
+				const size_t space = text.find(' ', pos);
+				if (space < eol)
+				{
+					const std::string moves = text.substr(pos, space - pos);
+					char *score_end;
+					const long score = std::strtol(text.c_str() + space + 1, &score_end, 10);
+					Position P;
+					if (score_end != text.c_str() + space + 1 && P.Play(moves) == moves.size() &&
+						score >= Position::MIN_SCORE && score <= Position::MAX_SCORE)
+					{
+						parts[t].push_back(OpeningBook::Record(P.Key3(), uint8_t(score - Position::MIN_SCORE + 1)));
+						depths[t] = std::max(depths[t], P.nbMoves());
+					}
+				}
+				pos = eol + 1;
+			}
+		};
+		std::vector<std::thread> pool;
+		for (unsigned int t = 1; t < threads; t++)
+			pool.emplace_back(parse, t);
+		parse(0);
+		for (std::thread &t : pool)
+			t.join();
+
+		for (unsigned int t = 0; t < threads; t++)
+		{
+			records.insert(records.end(), parts[t].begin(), parts[t].end());
+			depth = std::max(depth, depths[t]);
+		}
+	}
+
+	// Write the positions of a warmup text file to a binary warmup file
+	static bool ConvertWarmup(const std::string &text_file, const std::string &binary_file)
+	{
+		std::vector<uint64_t> records;
+		int depth;
+		ParseWarmup(text_file, records, depth);
+		return OpeningBook::save(binary_file, std::move(records), depth, OpeningBook::VERSION_TREE);
+	}
+
+	const OpeningBook &GetBook() const
+	{
+		return book;
+	}
+
+	SourceStats GetStats(const Source source) const
+	{
+		const size_t sizes[SOURCES] = {book.GetSize(), warmup.GetSize(), learnedCount.load()};
+		return {sizes[source], lookups[source].load(), hits[source].load()};
+	}
+
+	void ResetStats()
+	{
+		for (int s = 0; s < SOURCES; s++)
+		{
+			lookups[s] = 0;
+			hits[s] = 0;
+		}
+	}
+
+	// Forget the scores learned since the start (e.g. to time searches from scratch), the journal is left as it is
+	void ForgetLearned()
+	{
+		learned.Reset();
+		learnedCount = 0;
+		learnedDepth = -1;
+	}
+
+	// One line summary of the sources: positions, hits / lookups
+	void PrintStats(std::ostream &os) const
+	{
+		static const char *names[SOURCES] = {"book", "warmup", "learned"};
+		for (int s = 0; s < SOURCES; s++)
+		{
+			const SourceStats stats = GetStats(Source(s));
+			os << (s ? ", " : "") << names[s] << " (" << stats.size << "): "
+			   << stats.hits << "/" << stats.lookups << " hits";
+		}
+		os << "\n";
+	}
+
+	KnowledgeStore() : learned(1048573) // ~8MB, room for 786k learned positions
+	{
+	}
+
+private:
+	static const uint64_t KEY_MASK = (UINT64_C(1) << 56) - 1;
+
+	OpeningBook book;
+	OpeningBook warmup;
+	TranspositionTable learned;
+	std::atomic<size_t> learnedCount{0};
+	std::atomic<int> learnedDepth{-1};
+
+	std::unique_ptr<SolveJournal> journal;
+	unsigned long long journalMinNodes = 0;
+
+	mutable std::atomic<unsigned long long> lookups[SOURCES] = {};
+	mutable std::atomic<unsigned long long> hits[SOURCES] = {};
+
+	uint8_t Lookup(const uint64_t key, const int nb_moves, const int learned_depth, Counters &counters) const
+	{
+		if (nb_moves <= book.GetDepth())
+			if (uint8_t val = Count(BOOK, book.Get(key), counters))
+				return val;
+		if (nb_moves <= warmup.GetDepth())
+			if (uint8_t val = Count(WARMUP, warmup.Get(key), counters))
+				return val;
+		if (nb_moves <= learned_depth && key <= KEY_MASK)
+			if (uint8_t val = Count(LEARNED, learned.Get(key), counters))
+				return val;
+		return 0;
+	}
+
+	static uint8_t Count(const Source source, const uint8_t val, Counters &counters)
+	{
+		counters.lookups[source]++;
+		counters.hits[source] += val != 0;
+		return val;
+	}
+
+	void LearnValue(const uint64_t key, const int nb_moves, const uint8_t val)
+	{
+		if (learnedCount.load(std::memory_order_relaxed) >= learned.GetSize() / 4 * 3)
+			return;
+		if (learned.Get(key) == 0)
+			learnedCount.fetch_add(1, std::memory_order_relaxed);
+		learned.Put(key, val);
+
+		int depth = learnedDepth.load(std::memory_order_relaxed);
+		while (depth < nb_moves && !learnedDepth.compare_exchange_weak(depth, nb_moves, std::memory_order_relaxed))
+			;
+	}
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Read-only view of a whole file.
+ * On POSIX systems the file is memory-mapped: pages are only read from the disk when they are touched,
+ * and every process mapping the same file shares a single copy of it in the page cache.
+ * Elsewhere the file is simply read into memory.
+ */
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const std::string &filename)
+    {
+        Close();
+#ifndef _WIN32
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        if (size > 0)
+        {
+            void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                ::close(fd);
+                size = 0;
+                return false;
+            }
+            data = static_cast<const uint8_t *>(addr);
+            mapped = true;
+        }
+        ::close(fd); // the mapping stays valid after closing the descriptor
+        return true;
+#else
+        std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+        if (!ifs)
+            return false;
+        buffer.resize(static_cast<size_t>(ifs.tellg()));
+        ifs.seekg(0);
+        ifs.read(reinterpret_cast<char *>(buffer.data()), buffer.size());
+        data = buffer.data();
+        size = buffer.size();
+        return bool(ifs);
+#endif
+    }
+
+    void Close()
+    {
+#ifndef _WIN32
+        if (mapped)
+            munmap(const_cast<uint8_t *>(data), size);
+#endif
+        buffer.clear();
+        data = nullptr;
+        size = 0;
+        mapped = false;
+    }
+
+    const uint8_t *Data() const
+    {
+        return data;
+    }
+
+    size_t Size() const
+    {
+        return size;
+    }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::vector<uint8_t> buffer;
+};
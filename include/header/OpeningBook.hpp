@@ -1,76 +1,775 @@
 #pragma once
 
 #include "Position.hpp"
-#include "TranspositionTable.hpp"
+#include "MappedFile.hpp"
+#include "Crc32.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
 
+/**
+ * Opening book: exact scores of the positions up to a given number of moves, looked up directly by the solver.
+ *
+ * Every file starts with a 32 bytes header (magic "C4BK", format version, board width and height, book depth,
+ * number of positions), the rest depends on the version:
+ * - version 2 (compressed, written by default): the positions sorted by key, cut in blocks of BLOCK_SIZE.
+ *   In a block each position takes a fixed number of bits: the difference with the previous key, then the
+ *   score on 6 bits. The blocks are followed by an index (first key, offset, bit width and CRC of each block)
+ *   and a CRC of the header and the index. A lookup binary searches the index, then decodes a single block,
+ *   whose CRC is checked the first time it is read.
+ * - version 3 (hashed): a minimal perfect hash of the keys (PTHash-like: the keys are spread in buckets of
+ *   about 4, and each bucket has a pilot chosen so that its keys land on free slots), followed by one 4 bytes
+ *   slot per position holding a 26 bits fingerprint of the key and the score. A lookup reads the pilot of the
+ *   key's bucket then a single slot. The keys themselves are not stored, so a position missing from the book
+ *   is mistaken for a book position with probability 2^-26, and the book cannot be converted back.
+ *   The CRC of the whole file is checked when it is loaded.
+ * - version 1: one unused 8 bytes record, then the positions as 8 bytes records (lower 7 bytes: key,
+ *   upper byte: score - MIN_SCORE + 1) in Eytzinger order, i.e. the implicit binary search tree of the sorted keys
+ *   stored breadth-first from index 1. Bigger, but a lookup is a single walk down the tree.
+ * Old books (raw 8 bytes records without header, in any order) are still accepted, they are sorted in memory.
+ *
+ * The file is memory-mapped read-only: loading is instant and processes using the same book share one copy of it.
+ */
 class OpeningBook
 {
+private:
+    static const int KEY_BITS = 56;
+    static const uint64_t KEY_MASK = (UINT64_C(1) << KEY_BITS) - 1;
+    static const int SCORE_BITS = 6;
+    static const uint64_t SCORE_MASK = (UINT64_C(1) << SCORE_BITS) - 1;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint8_t width;
+        uint8_t height;
+        uint8_t depth;
+        uint8_t reserved[3];
+        uint32_t block_size;   // compressed format: number of positions per block
+        uint64_t count;
+        uint64_t index_offset; // compressed format: position of the block index in the file
+    };
+    static_assert(sizeof(Header) == 32, "Unexpected book header size");
+
+    struct BlockIndex
+    {
+        uint64_t first_key;
+        uint64_t offset; // position of the block in the file
+        uint32_t crc;
+        uint8_t width;   // number of bits of the key differences
+        uint8_t reserved[3];
+    };
+    static_assert(sizeof(BlockIndex) == 24, "Unexpected book index size");
+
+    struct HashHeader
+    {
+        uint64_t buckets;
+        uint64_t seed;
+        uint32_t crc; // of the header, bucket count, seed, pilots and slots
+        uint32_t reserved;
+    };
+    static_assert(sizeof(HashHeader) == 24, "Unexpected book hash header size");
+
+    static const int FINGERPRINT_BITS = 32 - SCORE_BITS;
+    static const int KEYS_PER_BUCKET = 4;
+
 public:
-    TranspositionTable *T;
+    static const uint32_t MAGIC = 0x4B423443; // "C4BK"
+    static const uint16_t VERSION_TREE = 1;
+    static const uint16_t VERSION_COMPRESSED = 2;
+    static const uint16_t VERSION_HASH = 3;
+    static const uint32_t BLOCK_SIZE = 64;
 
-    OpeningBook(TranspositionTable *table) : T(table) {}
+    // pack a key and its value in a book record
+    static uint64_t Record(const uint64_t key, const uint8_t val)
+    {
+        return (key & KEY_MASK) | uint64_t(val) << KEY_BITS;
+    }
 
-    void save(const std::string &filename) const
+    // number of stones of the position a key comes from (its non-zero base 3 digits)
+    static int CountStones(uint64_t key)
     {
-        std::ofstream ofs(filename, std::ios::binary);
-        if (!ofs)
+        int stones = 0;
+        for (; key; key /= 3)
+            stones += (key % 3 != 0);
+        return stones;
+    }
+
+    /**
+     * Streaming writer of compressed books: the records are given one by one in increasing key order,
+     * and each block is written as soon as it is full, so a book never has to fit in memory.
+     */
+    class Writer
+    {
+    public:
+        /**
+         * @param: filename, the book to create
+         * @param: depth, the maximum number of moves of the positions in the book
+         */
+        Writer(const std::string &filename, const int depth) : buffer(1 << 20)
+        {
+            ofs.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+            ofs.open(filename, std::ios::binary);
+            if (!ofs)
+            {
+                std::cerr << "Error: Can't open file " << filename << "\n";
+                return;
+            }
+            header.magic = MAGIC;
+            header.version = VERSION_COMPRESSED;
+            header.width = Position::WIDTH;
+            header.height = Position::HEIGHT;
+            header.depth = depth;
+            header.block_size = BLOCK_SIZE;
+            ofs.write(reinterpret_cast<const char *>(&header), sizeof(header)); // rewritten by Finish()
+            offset = sizeof(header);
+        }
+
+        explicit operator bool() const
+        {
+            return bool(ofs);
+        }
+
+        // Add a record packed with Record(), its key must be greater than the key of the previous record
+        bool Add(const uint64_t record)
+        {
+            const uint64_t key = record & KEY_MASK;
+            if ((header.count > 0 && key <= last_key) || (record >> KEY_BITS) > SCORE_MASK)
+            {
+                std::cerr << "Error: book records must be unique, sorted by key, with values below "
+                          << SCORE_MASK + 1 << "\n";
+                return false;
+            }
+            block.push_back(record);
+            last_key = key;
+            header.count++;
+            if (block.size() == BLOCK_SIZE)
+                FlushBlock();
+            return true;
+        }
+
+        // Write the end of the book (last block, index and header), returns false if anything went wrong
+        bool Finish()
+        {
+            FlushBlock();
+            const char padding[16] = {}; // a block can be decoded with 8 bytes reads, and the index is aligned
+            const size_t padding_size = 16 - offset % 8;
+            ofs.write(padding, padding_size);
+            header.index_offset = offset + padding_size;
+
+            ofs.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(BlockIndex));
+            uint32_t crc = Crc32(&header, sizeof(header));
+            crc = Crc32(index.data(), index.size() * sizeof(BlockIndex), crc);
+            ofs.write(reinterpret_cast<const char *>(&crc), sizeof(crc));
+            ofs.seekp(0);
+            ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            ofs.close();
+            return bool(ofs);
+        }
+
+        uint64_t GetCount() const
+        {
+            return header.count;
+        }
+
+    private:
+        std::vector<char> buffer;
+        std::ofstream ofs;
+        Header header{};
+        std::vector<BlockIndex> index;
+        std::vector<uint64_t> block;
+        std::vector<uint8_t> packed;
+        uint64_t last_key = 0;
+        uint64_t offset = 0;
+
+        void FlushBlock()
+        {
+            if (block.empty())
+                return;
+            BlockIndex entry{};
+            entry.first_key = block[0] & KEY_MASK;
+            entry.offset = offset;
+
+            uint64_t max_delta = 0;
+            for (size_t i = 1; i < block.size(); i++)
+                max_delta = std::max(max_delta, (block[i] & KEY_MASK) - (block[i - 1] & KEY_MASK));
+            entry.width = max_delta ? 64 - __builtin_clzll(max_delta) : 0;
+
+            const int bits = entry.width + SCORE_BITS;
+            packed.assign((block.size() * bits + 7) / 8, 0);
+            uint64_t previous = entry.first_key;
+            for (size_t i = 0; i < block.size(); i++)
+            {
+                const uint64_t key = block[i] & KEY_MASK;
+                PutBits(packed, i * bits, (key - previous) << SCORE_BITS | block[i] >> KEY_BITS, bits);
+                previous = key;
+            }
+            entry.crc = Crc32(packed.data(), packed.size());
+
+            ofs.write(reinterpret_cast<const char *>(packed.data()), packed.size());
+            offset += packed.size();
+            index.push_back(entry);
+            block.clear();
+        }
+    };
+
+    /**
+     * Write a book.
+     * @param: records, the positions of the book packed with Record(), in any order
+     * @param: depth, the maximum number of moves of the positions in the book
+     * @param: version, the file format (VERSION_COMPRESSED, VERSION_HASH or VERSION_TREE)
+     */
+    static bool save(const std::string &filename, std::vector<uint64_t> records, const int depth,
+                     const uint16_t version = VERSION_COMPRESSED)
+    {
+        SortRecords(records);
+
+        bool ok = true;
+        if (version == VERSION_TREE)
+            ok = saveTree(filename, records, depth);
+        else if (version == VERSION_HASH)
+            ok = saveHash(filename, records, depth);
+        else
+        {
+            Writer writer(filename, depth);
+            for (size_t i = 0; writer && ok && i < records.size(); i++)
+                ok = writer.Add(records[i]);
+            ok = ok && writer && writer.Finish();
+        }
+
+        if (ok)
+            std::cout << "Saved " << records.size() << " positions to " << filename << "\n";
+        return ok;
+    }
+
+    bool load(const std::string &filename)
+    {
+        close();
+        if (!file.Open(filename))
         {
             std::cerr << "Error: Can't open file " << filename << "\n";
-            return;
+            return false;
         }
 
-        size_t count = 0;
-        for (unsigned int i = 0; i < T->GetSize(); ++i)
+        Header header;
+        if (file.Size() >= sizeof(Header))
+            std::memcpy(&header, file.Data(), sizeof(Header));
+
+        if (file.Size() < sizeof(Header) || header.magic != MAGIC)
         {
-            uint64_t key = T->GetKeys()[i];
-            uint8_t move = T->Get(key);
+            loadLegacy();
+            std::cout << "Loaded " << count << " positions from " << filename << " (old format, sorted in memory)\n";
+            return true;
+        }
 
-            if (move != 0)
+        if (header.width != Position::WIDTH || header.height != Position::HEIGHT || !loadHeader(header))
+        {
+            std::cerr << "Error: " << filename << " is not a valid book for this board\n";
+            close();
+            return false;
+        }
+
+        std::cout << "Mapped " << count << " positions from " << filename << " (format " << version
+                  << ", depth " << depth << ")\n";
+        return true;
+    }
+
+    /**
+     * Use records kept in memory as the book, e.g. scores read from a text file.
+     * @param: records, the positions packed with Record(), in any order
+     * @param: depth, the maximum number of moves of the positions
+     */
+    void assign(std::vector<uint64_t> records, const int depth)
+    {
+        close();
+        SortRecords(records);
+        owned.assign(records.size() + 1, 0);
+        size_t next = 0;
+        BuildTree(records, owned, next, 1);
+        this->records = owned.data();
+        this->count = records.size();
+        this->depth = depth;
+    }
+
+    void close()
+    {
+        file.Close();
+        owned.clear();
+        owned.shrink_to_fit();
+        records = nullptr;
+        index = nullptr;
+        checked.reset();
+        pilots = nullptr;
+        slots = nullptr;
+        buckets = 0;
+        seed = 0;
+        count = 0;
+        blocks = 0;
+        depth = -1;
+        version = 0;
+    }
+
+    // Value stored for a key (score - MIN_SCORE + 1), 0 if the position is not in the book
+    uint8_t Get(uint64_t key) const
+    {
+        key &= KEY_MASK;
+        if (version == VERSION_COMPRESSED)
+            return GetCompressed(key);
+        if (version == VERSION_HASH)
+            return GetHashed(key);
+
+        size_t k = 1;
+        while (k <= count)
+        {
+            __builtin_prefetch(records + k * 8); // the 8 records of the tree 3 levels below share a cache line
+            k = 2 * k + ((records[k] & KEY_MASK) < key);
+        }
+        k >>= __builtin_ffsll(~k); // go back up to the last node where the search went left, it holds the lower bound
+        if (k && (records[k] & KEY_MASK) == key)
+            return uint8_t(records[k] >> KEY_BITS);
+        return 0;
+    }
+
+    // Call f(record) for every position of the book, returns false if the format does not keep the keys
+    template <class F>
+    bool ForEach(F f) const
+    {
+        if (version == VERSION_HASH)
+            return false;
+        if (version != VERSION_COMPRESSED)
+        {
+            for (size_t i = 1; i <= count; i++)
+                f(records[i]);
+            return true;
+        }
+        for (size_t b = 0; b < blocks; b++)
+        {
+            if (!CheckBlock(b))
+                continue;
+            DecodeBlock(b, [&](uint64_t key, uint64_t val)
+                        { f(Record(key, uint8_t(val))); return false; });
+        }
+        return true;
+    }
+
+    // Maximum number of moves of the positions in the book, -1 if no book is loaded
+    int GetDepth() const
+    {
+        return depth;
+    }
+
+    size_t GetSize() const
+    {
+        return count;
+    }
+
+    // File format of the loaded book (0 for the old format without header, or a book given to assign())
+    int GetVersion() const
+    {
+        return version;
+    }
+
+private:
+    enum BlockState : uint8_t
+    {
+        UNCHECKED,
+        VALID,
+        CORRUPTED
+    };
+
+    MappedFile file;
+    std::vector<uint64_t> owned; // records kept in memory (old format book or assign()), in Eytzinger order
+    const uint64_t *records = nullptr;
+    const BlockIndex *index = nullptr;
+    std::unique_ptr<std::atomic<uint8_t>[]> checked; // BlockState of each block of a compressed book
+    size_t count = 0;
+    size_t blocks = 0;
+    uint32_t block_size = 0;
+    const uint32_t *pilots = nullptr; // hashed format
+    const uint32_t *slots = nullptr;
+    uint64_t buckets = 0;
+    uint64_t seed = 0;
+    int depth = -1;
+    int version = 0;
+
+    static void PutBits(std::vector<uint8_t> &out, const size_t pos, const uint64_t value, const int n)
+    {
+        for (int i = 0; i < n; i++)
+            if (value >> i & 1)
+                out[(pos + i) / 8] |= uint8_t(1 << ((pos + i) % 8));
+    }
+
+    // read n <= 62 bits starting at bit pos (the data must be readable 9 bytes past pos / 8)
+    static uint64_t GetBits(const uint8_t *data, const size_t pos, const int n)
+    {
+        uint64_t word;
+        std::memcpy(&word, data + pos / 8, sizeof(word));
+        const int shift = pos % 8;
+        uint64_t value = word >> shift;
+        if (shift + n > 64)
+            value |= uint64_t(data[pos / 8 + 8]) << (64 - shift);
+        return value & ((UINT64_C(1) << n) - 1);
+    }
+
+    bool loadHeader(const Header &header)
+    {
+        depth = header.depth;
+        version = header.version;
+        count = header.count;
+
+        if (version == VERSION_TREE)
+        {
+            if (file.Size() < sizeof(Header) + (count + 1) * sizeof(uint64_t))
+                return false;
+            records = reinterpret_cast<const uint64_t *>(file.Data() + sizeof(Header));
+            return true;
+        }
+        if (version == VERSION_HASH)
+            return loadHash(header);
+        if (version != VERSION_COMPRESSED || header.block_size == 0)
+            return false;
+
+        block_size = header.block_size;
+        blocks = (count + block_size - 1) / block_size;
+        const size_t index_size = blocks * sizeof(BlockIndex);
+        if (header.index_offset % 8 != 0 || header.index_offset > file.Size() ||
+            file.Size() - header.index_offset < index_size + sizeof(uint32_t))
+            return false;
+
+        uint32_t crc;
+        std::memcpy(&crc, file.Data() + header.index_offset + index_size, sizeof(crc));
+        if (crc != Crc32(file.Data() + header.index_offset, index_size, Crc32(&header, sizeof(header))))
+        {
+            std::cerr << "Error: book header or index checksum mismatch\n";
+            return false;
+        }
+
+        index = reinterpret_cast<const BlockIndex *>(file.Data() + header.index_offset);
+        for (size_t b = 0; b < blocks; b++)
+            if (index[b].width > KEY_BITS || index[b].offset + BlockBytes(b) + 9 > header.index_offset)
+                return false;
+        checked.reset(new std::atomic<uint8_t>[blocks]);
+        for (size_t b = 0; b < blocks; b++)
+            checked[b].store(UNCHECKED, std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t BlockCount(const size_t b) const
+    {
+        return std::min<size_t>(block_size, count - b * block_size);
+    }
+
+    size_t BlockBytes(const size_t b) const
+    {
+        return (BlockCount(b) * (index[b].width + SCORE_BITS) + 7) / 8;
+    }
+
+    // check the CRC of a block the first time it is used, corrupted blocks are ignored
+    bool CheckBlock(const size_t b) const
+    {
+        uint8_t state = checked[b].load(std::memory_order_relaxed);
+        if (state == UNCHECKED)
+        {
+            const bool valid = Crc32(file.Data() + index[b].offset, BlockBytes(b)) == index[b].crc;
+            uint8_t expected = UNCHECKED;
+            if (checked[b].compare_exchange_strong(expected, valid ? VALID : CORRUPTED) && !valid)
+                std::cerr << "Error: book block " << b << " is corrupted, its positions are ignored\n";
+            state = valid ? VALID : CORRUPTED;
+        }
+        return state == VALID;
+    }
+
+    // call f(key, value) for the positions of a block in increasing key order, until f returns true
+    template <class F>
+    void DecodeBlock(const size_t b, F f) const
+    {
+        const uint8_t *data = file.Data() + index[b].offset;
+        const int bits = index[b].width + SCORE_BITS;
+        const size_t n = BlockCount(b);
+        uint64_t key = index[b].first_key;
+        for (size_t i = 0; i < n; i++)
+        {
+            const uint64_t entry = GetBits(data, i * bits, bits);
+            key += entry >> SCORE_BITS;
+            if (f(key, entry & SCORE_MASK))
+                return;
+        }
+    }
+
+    uint8_t GetCompressed(const uint64_t key) const
+    {
+        const BlockIndex *next = std::upper_bound(index, index + blocks, key, [](uint64_t k, const BlockIndex &e)
+                                                  { return k < e.first_key; });
+        if (next == index)
+            return 0;
+        const size_t b = next - index - 1;
+        if (!CheckBlock(b))
+            return 0;
+
+        uint8_t val = 0;
+        DecodeBlock(b, [&](uint64_t k, uint64_t v)
+                    {
+                        if (k == key)
+                            val = uint8_t(v);
+                        return k >= key; });
+        return val;
+    }
+
+    // bijective mix of the bits of a key (murmur3 finalizer)
+    static uint64_t Mix(uint64_t x)
+    {
+        x ^= x >> 33;
+        x *= UINT64_C(0xff51afd7ed558ccd);
+        x ^= x >> 33;
+        x *= UINT64_C(0xc4ceb9fe1a85ec53);
+        x ^= x >> 33;
+        return x;
+    }
+
+    // uniform value in [0, n) from the high bits of x
+    static uint64_t Range(const uint64_t x, const uint64_t n)
+    {
+        return uint64_t((unsigned __int128)x * n >> 64);
+    }
+
+    // 60% of the keys go to the first 30% of the buckets, so that the big buckets get placed first,
+    // while the table is still empty
+    static uint64_t Bucket(const uint64_t hash, const uint64_t buckets)
+    {
+        const uint64_t dense = buckets * 3 / 10;
+        if (uint32_t(hash) < UINT32_C(0x9999999A) || dense == buckets)
+            return Range(hash, dense ? dense : buckets);
+        return dense + Range(hash, buckets - dense);
+    }
+
+    static uint64_t Slot(const uint64_t hash, const uint32_t pilot, const uint64_t n)
+    {
+        return Range(Mix(hash + pilot * UINT64_C(0x9E3779B97F4A7C15)), n);
+    }
+
+    static uint32_t Fingerprint(const uint64_t hash)
+    {
+        return uint32_t(Mix(~hash) >> (64 - FINGERPRINT_BITS));
+    }
+
+    uint8_t GetHashed(const uint64_t key) const
+    {
+        if (count == 0)
+            return 0;
+        const uint64_t hash = Mix(key ^ seed);
+        const uint32_t slot = slots[Slot(hash, pilots[Bucket(hash, buckets)], count)];
+        if (slot >> SCORE_BITS != Fingerprint(hash))
+            return 0;
+        return uint8_t(slot & SCORE_MASK);
+    }
+
+    static uint32_t HashCrc(const Header &header, const HashHeader &hash_header, const uint32_t *pilots,
+                            const uint32_t *slots)
+    {
+        uint32_t crc = Crc32(&header, sizeof(header));
+        crc = Crc32(&hash_header.buckets, sizeof(hash_header.buckets), crc);
+        crc = Crc32(&hash_header.seed, sizeof(hash_header.seed), crc);
+        crc = Crc32(pilots, hash_header.buckets * sizeof(uint32_t), crc);
+        return Crc32(slots, header.count * sizeof(uint32_t), crc);
+    }
+
+    bool loadHash(const Header &header)
+    {
+        HashHeader hash_header;
+        if (file.Size() < sizeof(Header) + sizeof(HashHeader))
+            return false;
+        std::memcpy(&hash_header, file.Data() + sizeof(Header), sizeof(HashHeader));
+        if (hash_header.buckets == 0 ||
+            (file.Size() - sizeof(Header) - sizeof(HashHeader)) / sizeof(uint32_t) < hash_header.buckets + count)
+            return false;
+
+        pilots = reinterpret_cast<const uint32_t *>(file.Data() + sizeof(Header) + sizeof(HashHeader));
+        slots = pilots + hash_header.buckets;
+        if (HashCrc(header, hash_header, pilots, slots) != hash_header.crc)
+        {
+            std::cerr << "Error: book checksum mismatch\n";
+            return false;
+        }
+        buckets = hash_header.buckets;
+        seed = hash_header.seed;
+        return true;
+    }
+
+    /**
+     * Spread the keys in buckets with a seed, and find for each bucket the first pilot sending all its keys to free
+     * slots, trying at most max_pilots pilots.
+     * @return false if a bucket has no such pilot (the last buckets can be unlucky since there is one slot per key),
+     * another seed may succeed
+     */
+    static bool PlaceKeys(const std::vector<uint64_t> &sorted, const HashHeader &hash_header, const uint64_t max_pilots,
+                          std::vector<uint32_t> &pilots, std::vector<uint32_t> &slots)
+    {
+        const uint64_t n = sorted.size();
+
+        // group the keys by bucket, biggest buckets first
+        struct HashedKey
+        {
+            uint64_t bucket;
+            uint64_t hash;
+            uint8_t val;
+        };
+        std::vector<HashedKey> keys(n);
+        std::vector<uint32_t> sizes(hash_header.buckets, 0);
+        for (uint64_t i = 0; i < n; i++)
+        {
+            const uint64_t hash = Mix((sorted[i] & KEY_MASK) ^ hash_header.seed);
+            keys[i] = {Bucket(hash, hash_header.buckets), hash, uint8_t(sorted[i] >> KEY_BITS)};
+            sizes[keys[i].bucket]++;
+        }
+        std::sort(keys.begin(), keys.end(), [&](const HashedKey &a, const HashedKey &b)
+                  { return sizes[a.bucket] != sizes[b.bucket] ? sizes[a.bucket] > sizes[b.bucket] : a.bucket < b.bucket; });
+
+        pilots.assign(hash_header.buckets, 0);
+        slots.assign(n, 0);
+        std::vector<bool> taken(n, false);
+        std::vector<uint64_t> positions;
+        for (uint64_t begin = 0, end; begin < n; begin = end)
+        {
+            for (end = begin; end < n && keys[end].bucket == keys[begin].bucket; end++)
+                ;
+            uint64_t pilot = 0;
+            for (; pilot < max_pilots; pilot++)
             {
-                // Write lower 7 bytes of key
-                for (int j = 0; j < 7; ++j)
+                positions.clear();
+                for (uint64_t i = begin; i < end; i++)
                 {
-                    uint8_t byte = (key >> (8 * j)) & 0xFF;
-                    ofs.write(reinterpret_cast<const char *>(&byte), 1);
+                    const uint64_t pos = Slot(keys[i].hash, uint32_t(pilot), n);
+                    if (taken[pos] || std::find(positions.begin(), positions.end(), pos) != positions.end())
+                        break;
+                    positions.push_back(pos);
                 }
-                ofs.write(reinterpret_cast<const char *>(&move), 1);
-                ++count;
+                if (positions.size() == end - begin)
+                    break;
             }
+            if (pilot == max_pilots)
+                return false;
+            for (uint64_t i = begin; i < end; i++)
+            {
+                taken[positions[i - begin]] = true;
+                slots[positions[i - begin]] = Fingerprint(keys[i].hash) << SCORE_BITS | keys[i].val;
+            }
+            pilots[keys[begin].bucket] = uint32_t(pilot);
+        }
+        return true;
+    }
+
+    static bool saveHash(const std::string &filename, const std::vector<uint64_t> &sorted, const int depth)
+    {
+        static const int MAX_SEEDS = 8;
+        const uint64_t n = sorted.size();
+        HashHeader hash_header{};
+        hash_header.buckets = std::max<uint64_t>(1, n / KEYS_PER_BUCKET);
+
+        // the last free slot takes about n pilots to hit, so a bucket needing 16n of them is very unlikely:
+        // bad luck with a seed (or keys hashing the same way) rather than a slow search
+        const uint64_t max_pilots = std::min<uint64_t>(UINT32_MAX, 16 * n + (1 << 16));
+        std::vector<uint32_t> pilots, slots;
+        bool placed = false;
+        for (int attempt = 0; attempt < MAX_SEEDS && !placed; attempt++)
+        {
+            hash_header.seed = UINT64_C(0x2545F4914F6CDD1D) + attempt * UINT64_C(0x9E3779B97F4A7C15);
+            placed = PlaceKeys(sorted, hash_header, max_pilots, pilots, slots);
+        }
+        if (!placed)
+        {
+            std::cerr << "Error: Can't build the hash of " << filename << " after " << MAX_SEEDS << " seeds\n";
+            return false;
         }
 
+        Header header{};
+        header.magic = MAGIC;
+        header.version = VERSION_HASH;
+        header.width = Position::WIDTH;
+        header.height = Position::HEIGHT;
+        header.depth = depth;
+        header.count = n;
+        hash_header.crc = HashCrc(header, hash_header, pilots.data(), slots.data());
+
+        std::ofstream ofs(filename, std::ios::binary);
+        if (!ofs)
+        {
+            std::cerr << "Error: Can't open file " << filename << "\n";
+            return false;
+        }
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char *>(&hash_header), sizeof(hash_header));
+        ofs.write(reinterpret_cast<const char *>(pilots.data()), pilots.size() * sizeof(uint32_t));
+        ofs.write(reinterpret_cast<const char *>(slots.data()), slots.size() * sizeof(uint32_t));
         ofs.close();
-        std::cout << "Saved " << count << " positions to " << filename << "\n";
+        return bool(ofs);
     }
 
-    void load(const std::string &filename)
+    static bool saveTree(const std::string &filename, const std::vector<uint64_t> &sorted, const int depth)
     {
-        std::ifstream ifs(filename, std::ios::binary);
-        if (!ifs)
+        std::vector<uint64_t> tree(sorted.size() + 1, 0);
+        size_t next = 0;
+        BuildTree(sorted, tree, next, 1);
+
+        std::ofstream ofs(filename, std::ios::binary);
+        if (!ofs)
         {
             std::cerr << "Error: Can't open file " << filename << "\n";
-            return;
+            return false;
         }
 
-        uint8_t buf[8]; // 8 bytes key + 1 byte move
-        size_t loaded = 0;
-        while (ifs.read(reinterpret_cast<char *>(buf), 8))
+        Header header{};
+        header.magic = MAGIC;
+        header.version = VERSION_TREE;
+        header.width = Position::WIDTH;
+        header.height = Position::HEIGHT;
+        header.depth = depth;
+        header.count = sorted.size();
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char *>(tree.data()), tree.size() * sizeof(uint64_t));
+        ofs.close();
+        return bool(ofs);
+    }
+
+    // fill tree[k] and its subtrees with sorted[next...] (in-order traversal of the implicit tree)
+    static void BuildTree(const std::vector<uint64_t> &sorted, std::vector<uint64_t> &tree, size_t &next, const size_t k)
+    {
+        if (k >= tree.size())
+            return;
+        BuildTree(sorted, tree, next, 2 * k);
+        tree[k] = sorted[next++];
+        BuildTree(sorted, tree, next, 2 * k + 1);
+    }
+
+    // sort records by key and remove the duplicated keys, keeping the last record of each key
+    static void SortRecords(std::vector<uint64_t> &records)
+    {
+        std::stable_sort(records.begin(), records.end(), [](uint64_t a, uint64_t b)
+                         { return (a & KEY_MASK) < (b & KEY_MASK); });
+        size_t out = 0;
+        for (size_t i = 0; i < records.size(); i++)
         {
-            uint64_t key = 0;
-            for (int i = 0; i < 7; ++i)
-            {
-                key |= (uint64_t(buf[i]) << (8 * i));
-            }
-            uint8_t move = buf[7];
-            T->Put(key, move);
-            ++loaded;
+            if (i + 1 < records.size() && (records[i + 1] & KEY_MASK) == (records[i] & KEY_MASK))
+                continue; // the last record of a key wins, as when the records are read one after the other
+            records[out++] = records[i];
         }
+        records.resize(out);
+    }
+
+    void loadLegacy()
+    {
+        std::vector<uint64_t> records(file.Size() / sizeof(uint64_t));
+        std::memcpy(records.data(), file.Data(), records.size() * sizeof(uint64_t));
 
-        ifs.close();
-        std::cout << "Loaded " << loaded << " positions from " << filename << "\n";
-        std::cout << "Collisions: " << T->collisions << "\n";
+        int depth = 0;
+        for (uint64_t record : records)
+            depth = std::max(depth, CountStones(record & KEY_MASK));
+        assign(std::move(records), depth);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Process a stream of items on several threads and get the results back in input order:
+ * - a reader thread calls read(input) until it returns false, and queues the inputs,
+ * - threads workers take the inputs from the queue as soon as they are free and call work(worker, input),
+ *   worker being the index of the worker in [0;threads), e.g. to use a solver of its own,
+ * - the calling thread hands the outputs to write(output) in the order of the inputs.
+ * At most capacity inputs are read but not written yet, which bounds the memory used whatever the length of the
+ * stream, and lets a slow item be overtaken by capacity - 1 others before the reader waits for it.
+ */
+template <class Input, class Output, class Read, class Work, class Write>
+void RunOrdered(const unsigned int threads, const size_t capacity, Read read, Work work, Write write)
+{
+    std::mutex mutex;
+    std::condition_variable has_input, has_output, has_room;
+    std::deque<std::pair<size_t, Input>> queue;
+    std::map<size_t, Output> outputs; // done, waiting for the outputs of the inputs read before
+    size_t read_count = 0;
+    size_t written = 0;
+    bool end = false;
+
+    std::thread reader([&]
+                       {
+        while (true)
+        {
+            Input input;
+            if (!read(input))
+                break;
+            std::unique_lock<std::mutex> lock(mutex);
+            has_room.wait(lock, [&]
+                          { return read_count - written < capacity; });
+            queue.emplace_back(read_count++, std::move(input));
+            has_input.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        end = true;
+        has_input.notify_all();
+        has_output.notify_all(); });
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < std::max(1u, threads); t++)
+    {
+        workers.emplace_back([&, t]
+                             {
+            while (true)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                has_input.wait(lock, [&]
+                               { return end || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                std::pair<size_t, Input> item = std::move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+
+                Output output = work(t, item.second);
+
+                lock.lock();
+                outputs.emplace(item.first, std::move(output));
+                if (item.first == written)
+                    has_output.notify_one();
+            } });
+    }
+
+    std::vector<Output> ready;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            has_output.wait(lock, [&]
+                            { return (!outputs.empty() && outputs.begin()->first == written) ||
+                                     (end && written == read_count); });
+            for (auto it = outputs.begin(); it != outputs.end() && it->first == written + ready.size();)
+            {
+                ready.push_back(std::move(it->second));
+                it = outputs.erase(it);
+            }
+        }
+        if (ready.empty())
+            break;
+        for (Output &output : ready)
+            write(output);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            written += ready.size();
+            has_room.notify_one();
+        }
+        ready.clear();
+    }
+
+    reader.join();
+    for (std::thread &t : workers)
+        t.join();
+}
@@ -10,6 +10,11 @@ constexpr static uint64_t Bottom(int width, int height)
 	return width == 0 ? 0 : Bottom(width - 1, height) | 1LL << (width - 1) * (height + 1);
 }
 
+constexpr static uint64_t Power(uint64_t base, int exponent)
+{
+	return exponent == 0 ? 1 : base * Power(base, exponent - 1);
+}
+
 // Representation of a game state, using 2 main bitmask: mask and current_position
 // Example:
 // board
@@ -49,6 +54,10 @@ public:
 		return hidden_mask;
 	}
 
+	uint64_t GetBlockedMask() const {
+		return blocked_mask;
+	}
+
 	static const int WIDTH = 7;
 	static const int HEIGHT = 6;
 	static const int MIN_SCORE = -(WIDTH * HEIGHT) / 2 + 3;
@@ -65,7 +74,7 @@ public:
 
 	bool CanPlay(int col) const
 	{
-		return (mask & TopMask(col)) == 0;
+		return (mask & TopMask(col)) == 0 && (MoveInCol(col) & blocked_mask) == 0;
 	}
 
 	void Play(uint64_t move)
@@ -75,15 +84,21 @@ public:
 		moves++;
 	}
 
+	// return a bitmask containing a single 1 corresponding to the cell played in a given column
+	uint64_t MoveInCol(int col) const
+	{
+		return (mask + BottomMaskCol(col)) & ColumnMask(col);
+	}
+
 	void PlayCol(int col)
 	{
-		Play((mask + BottomMaskCol(col)) & ColumnMask(col));
+		Play(MoveInCol(col));
 	}
 
 	// Check if move in a column is overlapped with the hidden positions
 	bool OverlapWithHiddenPos(int col) const
 	{
-		uint64_t move = (mask + BottomMaskCol(col)) & ColumnMask(col);
+		uint64_t move = MoveInCol(col);
 		if ((move & hidden_mask) == 0) return false;
 		else return true;
 	}
@@ -115,6 +130,12 @@ public:
 		return moves;
 	}
 
+	// number of cells that can still receive a stone once the game is over (all of them except the blocked ones)
+	int nbCells() const
+	{
+		return WIDTH * HEIGHT - CountSetBits(blocked_mask);
+	}
+
 	uint64_t Key() const
 	{
 		return current_position + mask;
@@ -138,9 +159,12 @@ public:
 
 	int MoveScore(uint64_t move) const
 	{
-		return CountSetBits(ComputeWinningPosition(current_position | move, mask));
+		return CountSetBits(ComputeWinningPosition(current_position | move, mask) & ~blocked_mask);
 	}
 
+	// Key of the stones of the position in base 3, the same for the mirror image, used by the book and the knowledge
+	// store. Hidden cells are left out: boards with hidden cells are kept out of the knowledge store (see Solver)
+	// and the table tells them apart with TableKey()
 	uint64_t Key3() const
 	{
 		uint64_t key_forward = 0;
@@ -151,7 +175,43 @@ public:
 		for (int i = Position::WIDTH; i--;)
 			PartialKey3(key_reverse, i); // compute key in decreasing order of columns
 
-		return key_forward < key_reverse ? key_forward / 3 : key_reverse / 3; // take the smallest key and divide per 3 as the last base3 digit is always 0
+		key_forward /= 3; // the last base3 digit is always 0
+		key_reverse /= 3;
+
+		return key_forward < key_reverse ? key_forward : key_reverse; // take the smallest key
+	}
+
+	/**
+	 * Key of the position in the transposition table, the same for the mirror image. Unlike Key3(), which outgrows
+	 * 56 bits from about 30 stones, it stays below 2^56 for every position, so that the table keeps it whole:
+	 * - a normal board is keyed by Key() (49 bits), or by the Key() of its mirror image if it is smaller
+	 * - a board with hidden cells is keyed from 2^49 up by the state of each column (its stones and free height),
+	 *   so that it never shares an entry with a normal board
+	 */
+	uint64_t TableKey() const
+	{
+		if (!blocked_mask)
+		{
+			const uint64_t key = Key();
+			const uint64_t mirror = MirrorKey(key);
+			return key < mirror ? key : mirror;
+		}
+
+		uint64_t key_forward = 0;
+		for (int i = 0; i < Position::WIDTH; i++)
+			PartialBlockedTableKey(key_forward, i);
+		uint64_t key_reverse = 0;
+		for (int i = Position::WIDTH; i--;)
+			PartialBlockedTableKey(key_reverse, i);
+		return (UINT64_C(1) << WIDTH * (HEIGHT + 1)) + (key_forward < key_reverse ? key_forward : key_reverse);
+	}
+
+	// append the state of a column of a board with hidden cells: the Key() bits of its stones, offset by its free height
+	void PartialBlockedTableKey(uint64_t &key, int col) const
+	{
+		const int free_height = FreeHeight(col);
+		const uint64_t stones = Key() >> col * (HEIGHT + 1) & COLUMN_KEY_MASK; // below 2^(free_height + 1) - 1
+		key = key * BLOCKED_COLUMN_STATES + (UINT64_C(1) << (free_height + 1)) - 2 - free_height + stones;
 	}
 
 	void PartialKey3(uint64_t &key, int col) const
@@ -172,9 +232,9 @@ public:
 		return (mask == 0);
 	}
 
-	Position() : current_position{0}, mask{0}, hidden_mask{0}, moves{0} {}
+	Position() : current_position{0}, mask{0}, hidden_mask{0}, blocked_mask{0}, moves{0} {}
 
-	Position(const std::vector<std::vector<int>> &board) : current_position{0}, mask{0}, hidden_mask{0}, moves{0}
+	Position(const std::vector<std::vector<int>> &board) : current_position{0}, mask{0}, hidden_mask{0}, blocked_mask{0}, moves{0}
 	{
 		for (const auto& v : board) {
 			for (const int i : v) {
@@ -201,17 +261,50 @@ public:
 				}
 			}
 		}
+
+		// a hidden cell can never be played, and neither can the cells above it
+		for (int col = 0; col < WIDTH; ++col)
+		{
+			if (uint64_t column_hidden = hidden_mask & ColumnMask(col))
+			{
+				uint64_t lowest_hidden = column_hidden & (~column_hidden + 1);
+				blocked_mask |= ColumnMask(col) & ~(lowest_hidden - 1);
+			}
+		}
 	}
 
 private:
 	uint64_t current_position;
 	uint64_t mask;
 	uint64_t hidden_mask;
+	uint64_t blocked_mask; // hidden cells and every cell above them, they act as walls for both players
 	unsigned int moves;
 
 	const static uint64_t bottom_mask_full = Bottom(WIDTH, HEIGHT);
 	const static uint64_t board_mask = bottom_mask_full * ((1LL << HEIGHT) - 1);
 
+	// bits of a column in Key(), and number of states of a column in TableKey() (2^(f+1) - 1 for each free height f)
+	static const uint64_t COLUMN_KEY_MASK = (UINT64_C(1) << (HEIGHT + 1)) - 1;
+	static const uint64_t BLOCKED_COLUMN_STATES = (UINT64_C(1) << (HEIGHT + 2)) - 2 - (HEIGHT + 1);
+	static_assert((UINT64_C(1) << WIDTH * (HEIGHT + 1)) + Power(BLOCKED_COLUMN_STATES, WIDTH) <= UINT64_C(1) << 56,
+				  "Table keys do not fit in 56 bits");
+
+	// number of cells of a column below its first blocked cell (HEIGHT if it is not blocked)
+	int FreeHeight(int col) const
+	{
+		uint64_t column_blocked = blocked_mask & ColumnMask(col);
+		return column_blocked ? __builtin_ctzll(column_blocked) - col * (HEIGHT + 1) : HEIGHT;
+	}
+
+	// Key() of the mirror image of a board, from the Key() of the board
+	static uint64_t MirrorKey(const uint64_t key)
+	{
+		uint64_t mirror = 0;
+		for (int col = 0; col < WIDTH; col++)
+			mirror |= (key >> col * (HEIGHT + 1) & COLUMN_KEY_MASK) << (WIDTH - 1 - col) * (HEIGHT + 1);
+		return mirror;
+	}
+
 	// return a bitmask containing a single 1 corresponding to the top cel of a given column
 	static uint64_t TopMask(int col)
 	{
@@ -226,17 +319,17 @@ private:
 
 	uint64_t Possible() const
 	{
-		return (mask + bottom_mask_full) & board_mask;
+		return (mask + bottom_mask_full) & board_mask & ~blocked_mask;
 	}
 
 	uint64_t WinningPosition() const
 	{
-		return ComputeWinningPosition(current_position, mask);
+		return ComputeWinningPosition(current_position, mask) & ~blocked_mask;
 	}
 
 	uint64_t OpponentWinningPosition() const
 	{
-		return ComputeWinningPosition(current_position ^ mask, mask);
+		return ComputeWinningPosition(current_position ^ mask, mask) & ~blocked_mask;
 	}
 
 	static uint64_t ComputeWinningPosition(uint64_t position, uint64_t mask)
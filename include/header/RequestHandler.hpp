@@ -3,6 +3,7 @@
 #include "lib/httplib.h"
 #include "lib/json.hpp"
 #include "Solver.hpp"
+#include "HardPositionMiner.hpp"
 #include "Position.hpp"
 
 #include <future>
@@ -18,6 +19,10 @@ private:
     string ip;
     uint16_t port;
     Solver solver;
+    unique_ptr<HardPositionMiner> miner; // solves the hard positions in the background, between requests
+    // Score of the position analyzed in the previous request of the current game, the same player is to move
+    // two plies later so it is a good guess to seed the next solve with
+    int last_score = Solver::NO_HINT;
 
     static void Log(const vector<vector<int>> &board, const int &current_player, const vector<int> &valid_moves, const bool &is_new_game)
     {
@@ -41,6 +46,10 @@ private:
 
     int GetMoveFromSolver(const vector<vector<int>> &board, const bool &is_new_game, const int &current_player, const vector<int> &valid_moves)
     {
+        if (is_new_game)
+        {
+            last_score = Solver::NO_HINT;
+        }
         if (is_new_game && current_player == 1)
         {
             return solver.GetDefaultFirstMove();
@@ -48,8 +57,22 @@ private:
 
         Position P(board);
 
-        packaged_task<vector<vector<int>>(Solver&, const Position&)> task(&Solver::Analyze);
+        // Only the columns the platform allows, and whose next cell is not hidden, are searched
+        unsigned int allowed_cols = 0;
+        for (const int col : valid_moves)
+        {
+            if (col >= 0 && col < Position::WIDTH && P.CanPlay(col) && !P.OverlapWithHiddenPos(col))
+            {
+                allowed_cols |= 1u << col;
+            }
+        }
 
+        const int hint = last_score;
+        packaged_task<vector<vector<int>>(Solver&, const Position&)> task(
+            [hint, allowed_cols](Solver &s, const Position &pos)
+            { return s.Analyze(pos, false, chrono::duration<double, milli>::max(), hint, allowed_cols, true); });
+
+        const auto analyze_start = chrono::steady_clock::now();
         future<vector<vector<int>>> analyze_future = task.get_future();
         thread analyze_thread(move(task), ref(solver), P);
 
@@ -61,10 +84,21 @@ private:
             if (analyze_thread.joinable()) {
                 analyze_thread.detach();
             }
+            last_score = Solver::NO_HINT;
+            miner->Submit(P, timeout * 1000.0, 0);
             random_device rd;
             mt19937 gen(rd());
-            uniform_int_distribution<> distrib(0, 6);
-            const int random_move = distrib(gen);
+            int random_move;
+            if (valid_moves.empty())
+            {
+                uniform_int_distribution<> distrib(0, Position::WIDTH - 1);
+                random_move = distrib(gen);
+            }
+            else
+            {
+                uniform_int_distribution<> distrib(0, static_cast<int>(valid_moves.size()) - 1);
+                random_move = valid_moves[distrib(gen)];
+            }
 
             cout << "[Solver] Computation timed out after " << timeout << " seconds. Using random move: " << random_move + 1 << "\n";
             return random_move;
@@ -75,6 +109,14 @@ private:
             if (analyze_thread.joinable()) {
                 analyze_thread.join();
             }
+            const SolveStats &stats = solver.GetLastStats();
+            last_score = stats.score;
+            const chrono::duration<double, milli> analyze_time = chrono::steady_clock::now() - analyze_start;
+            if (miner->Submit(P, analyze_time.count(), stats.nodes))
+                cout << "[Solver] Hard position, queued for the miner\n";
+            cout << "[Solver] Score: " << stats.score << ", Probes: " << stats.probes << ", Nodes: " << stats.nodes << "\n";
+            cout << "[Solver] Knowledge: ";
+            solver.knowledge.PrintStats(cout);
             vector<int> move_list = {};
             for (const auto &cols : ranked_moves)
             {
@@ -120,9 +162,16 @@ private:
     }
 
 public:
-    RequestHandler(string ip, const uint16_t port) : ip(std::move(ip)), port(port)
+    // journal_min_nodes: the positions solved with at least this number of nodes are kept for the next runs
+    // driver: strategy of the solves, the miner threads use it too
+    RequestHandler(string ip, const uint16_t port, const unsigned long long journal_min_nodes,
+                   const HardPositionMiner::Options &miner_options = {}, const SolveDriver driver = SolveDriver::Mtdf)
+        : ip(std::move(ip)), port(port)
     {
+        solver.SetDriver(driver);
         solver.GetReady();
+        solver.OpenJournal(journal_min_nodes);
+        miner = make_unique<HardPositionMiner>(solver, miner_options);
     }
 
     void Run()
@@ -130,6 +179,7 @@ public:
         auto handle{
             [&](const httplib::Request &req, httplib::Response &res)
             {
+                HardPositionMiner::PauseGuard pause(*miner);
                 try
                 {
                     json req_data = json::parse(req.body);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+/**
+ * Lets background searches give way to the real work: a solver with a throttle calls Checkpoint() every few thousand
+ * nodes, which
+ * - sleeps as long as needed for the searching threads to use at most the given share of a core each,
+ * - blocks while the throttle is paused (e.g. while a request is being answered),
+ * - throws SearchThrottle::Stopped once Stop() has been called, to abandon the search.
+ */
+class SearchThrottle
+{
+public:
+	struct Stopped
+	{
+	};
+
+	// cpu_share: fraction of a core each searching thread may use, in (0;1]
+	explicit SearchThrottle(double cpu_share = 1.0) : share(std::max(0.01, std::min(1.0, cpu_share)))
+	{
+	}
+
+	// Pauses nest: the searches resume once every Pause() has been matched by a Resume()
+	void Pause()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		paused++;
+	}
+
+	void Resume()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (paused > 0)
+			paused--;
+		cv.notify_all();
+	}
+
+	void Stop()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopped = true;
+		cv.notify_all();
+	}
+
+	void Checkpoint()
+	{
+		using clock = std::chrono::steady_clock;
+		thread_local clock::time_point slice_start = clock::now();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		const clock::duration worked = clock::now() - slice_start;
+		if (share < 1.0 && worked >= SLICE)
+		{
+			cv.wait_for(lock, std::chrono::duration_cast<clock::duration>(worked * ((1.0 - share) / share)),
+						[&]
+						{ return stopped; });
+			slice_start = clock::now();
+		}
+		if (paused > 0)
+		{
+			cv.wait(lock, [&]
+					{ return stopped || paused == 0; });
+			slice_start = clock::now();
+		}
+		if (stopped)
+			throw Stopped();
+	}
+
+private:
+	static constexpr std::chrono::milliseconds SLICE{20};
+
+	const double share;
+	int paused = 0;
+	bool stopped = false;
+	std::mutex mutex;
+	std::condition_variable cv;
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "Crc32.hpp"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/**
+ * Append-only file of exact scores, so that positions solved by a previous run are known at the next start.
+ * The file is a sequence of 16 bytes entries: the record (key and value, as in OpeningBook::Record), the number of
+ * moves of the position and a CRC of the entry. Each entry is written at once and synced to the disk, so a crash
+ * can at most leave a torn entry at the end of the file: it fails its CRC, and the file is rewritten without it
+ * when it is opened again.
+ *
+ * The same position may be appended several times (e.g. by runs that could not keep it in memory), the file is then
+ * compacted on a background thread: its unique entries are written to a new file which replaces the old one.
+ */
+class SolveJournal
+{
+public:
+	SolveJournal() = default;
+	SolveJournal(const SolveJournal &) = delete;
+	SolveJournal &operator=(const SolveJournal &) = delete;
+
+	~SolveJournal()
+	{
+		if (compactor.joinable())
+			compactor.join();
+		if (file)
+			std::fclose(file);
+	}
+
+	/**
+	 * Open a journal (created if it does not exist) and read its entries.
+	 * @param: f, called as f(record, nb_moves) for each valid entry, in the order they were appended
+	 */
+	template <class F>
+	bool Open(const std::string &filename, F f)
+	{
+		path = filename;
+		std::vector<Entry> entries;
+		const bool torn = Read(entries);
+		std::unordered_map<uint64_t, size_t> unique;
+		for (const Entry &e : entries)
+		{
+			unique[e.record & KEY_MASK]++;
+			f(e.record, int(e.moves));
+		}
+
+		if (torn)
+		{
+			std::cerr << "Warning: " << path << " ends with a torn entry, rewriting it\n";
+			Rewrite(entries);
+		}
+
+		file = std::fopen(path.c_str(), "ab");
+		if (!file)
+		{
+			std::cerr << "Error: Can't open file " << path << "\n";
+			return false;
+		}
+		if (unique.size() < entries.size())
+			compactor = std::thread(&SolveJournal::Compact, this);
+		return true;
+	}
+
+	// Append the exact score of a position, safe to call from several threads
+	void Append(const uint64_t record, const int nb_moves)
+	{
+		Entry e{};
+		e.record = record;
+		e.moves = uint8_t(nb_moves);
+		e.crc = Crc32(&e, offsetof(Entry, crc));
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!file)
+			return;
+		std::fwrite(&e, sizeof(e), 1, file);
+		Sync(file);
+	}
+
+	// Rewrite the journal with a single entry per position (the last one appended)
+	void Compact()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<Entry> entries;
+		Read(entries);
+
+		std::unordered_map<uint64_t, size_t> last;
+		for (size_t i = 0; i < entries.size(); i++)
+			last[entries[i].record & KEY_MASK] = i;
+		std::vector<Entry> unique;
+		for (size_t i = 0; i < entries.size(); i++)
+			if (last[entries[i].record & KEY_MASK] == i)
+				unique.push_back(entries[i]);
+
+		if (file)
+			std::fclose(file);
+		Rewrite(unique);
+		file = std::fopen(path.c_str(), "ab");
+	}
+
+private:
+	static const uint64_t KEY_MASK = (UINT64_C(1) << 56) - 1;
+
+	struct Entry
+	{
+		uint64_t record;
+		uint8_t moves;
+		uint8_t reserved[3];
+		uint32_t crc; // of the bytes above
+	};
+	static_assert(sizeof(Entry) == 16, "Unexpected journal entry size");
+
+	std::string path;
+	std::FILE *file = nullptr;
+	std::mutex mutex;
+	std::thread compactor;
+
+	static void Sync(std::FILE *f)
+	{
+		std::fflush(f);
+#ifndef _WIN32
+		fsync(fileno(f));
+#endif
+	}
+
+	// read the valid entries of the journal, returns true if it has a torn or corrupted end
+	bool Read(std::vector<Entry> &entries) const
+	{
+		std::ifstream ifs(path, std::ios::binary);
+		Entry e;
+		while (ifs.read(reinterpret_cast<char *>(&e), sizeof(e)))
+		{
+			if (e.crc != Crc32(&e, offsetof(Entry, crc)))
+				return true;
+			entries.push_back(e);
+		}
+		return ifs.gcount() != 0;
+	}
+
+	// replace the journal by the given entries, the old file stays in place until the new one is complete
+	void Rewrite(const std::vector<Entry> &entries) const
+	{
+		const std::string tmp = path + ".tmp";
+		std::FILE *out = std::fopen(tmp.c_str(), "wb");
+		if (!out)
+		{
+			std::cerr << "Error: Can't open file " << tmp << "\n";
+			return;
+		}
+		std::fwrite(entries.data(), sizeof(Entry), entries.size(), out);
+		Sync(out);
+		std::fclose(out);
+#ifdef _WIN32
+		std::remove(path.c_str()); // rename does not replace an existing file there
+#endif
+		std::rename(tmp.c_str(), path.c_str());
+	}
+};
@@ -3,7 +3,8 @@
 #include "TranspositionTable.hpp"
 #include "Position.hpp"
 #include "MoveSorter.hpp"
-#include "OpeningBook.hpp"
+#include "KnowledgeStore.hpp"
+#include "SearchThrottle.hpp"
 
 #include <random>
 #include <chrono>
@@ -11,14 +12,40 @@
 #include <map>
 #include <algorithm>
 #include <thread>
+#include <limits>
+#include <memory>
+#include <atomic>
 
 const std::string OPENING_BOOK_PATH = "data/depth_12_scores_7x6.book";
 const std::string WARMUP_BOOK_PATH = "data/warmup.book";
+const std::string WARMUP_BINARY_PATH = "data/warmup.bin";
+const std::string JOURNAL_PATH = "data/solved.journal";
+
+// Strategy used by Solve() to narrow down the score with null window searches
+enum class SolveDriver
+{
+	Bisection, // split the [min;max] window in half at each probe
+	Mtdf	   // memory-enhanced test driver, probe around a guess of the score and move towards the real one
+};
+
+// Statistics of the last Solve() (or the whole Analyze() for a root position, or SolveBatch() without a score)
+struct SolveStats
+{
+	int score = 0;
+	int probes = 0; // number of null window Negamax calls made from the root
+	unsigned long long nodes = 0;
+};
 
 class Solver
 {
 private:
 	unsigned long long nodeCount;
+	SolveDriver driver;
+	SolveStats lastStats;
+	std::shared_ptr<TranspositionTable> sharedTable; // owner of transTable, shared with the solvers of SolveBatch()
+	std::shared_ptr<KnowledgeStore> sharedKnowledge; // owner of knowledge, shared the same way
+	SearchThrottle *throttle = nullptr;				 // checked regularly by the search when set (background solvers)
+	KnowledgeStore::Counters knowledgeCounters;		 // lookups of the search, merged into the store after each solve
 
 	// Use a column order to set priority for exploring nodes (columns tend to affect the game more the more they are near the middle)
 	int columnOrder[Position::WIDTH];
@@ -38,12 +65,14 @@ private:
 		// assert(!P.CanWinNext());
 
 		nodeCount++;
+		if (throttle && (nodeCount & 0xFFF) == 0)
+			throttle->Checkpoint();
 
 		uint64_t next = P.PossibleNonLosingMoves();
 		if (next == 0)
 			return -(Position::WIDTH * Position::HEIGHT - P.nbMoves()) / 2; // opponent wins since there are no possible non-losing move
 
-		if (P.nbMoves() >= Position::WIDTH * Position::HEIGHT - 2)
+		if (P.nbMoves() >= P.nbCells() - 2)
 			return 0; // draw game
 
 		// min is used for narrowing down the window (min means the smallest number of moves needed for the opponent to win)
@@ -57,7 +86,8 @@ private:
 
 		// max is the smallest number of moves needed for the current player to win, also used to narrow down window.
 		int max = (Position::WIDTH * Position::HEIGHT - 1 - P.nbMoves()) / 2;
-		if (int val = int(transTable.Get(P.Key3()))) // check if the current state is in transTable or not, if it is, retrieve the value
+		const uint64_t key = P.TableKey();
+		if (int val = int(transTable.Get(key))) // check if the current state is in transTable or not, if it is, retrieve the value
 			max = val + Position::MIN_SCORE - 1;
 
 		if (beta > max)
@@ -67,6 +97,11 @@ private:
 				return beta; // prune the exploration if the [alpha;beta] window is empty.
 		}
 
+		// only when the bound of the table did not prune the node, most nodes are never looked up
+		if (Knowable(P))
+			if (int val = int(knowledge.Probe(P.Key3(), P.nbMoves(), knowledgeCounters)))
+				return val + Position::MIN_SCORE - 1; // exact score from the book, the warmup or a previous solve
+
 		MoveSorter moves;
 		for (int i = Position::WIDTH; i--;)
 			if (uint64_t move = next & Position::ColumnMask(columnOrder[i]))
@@ -85,26 +120,33 @@ private:
 		}
 
 		// save the upper bound of the position, minus MIN_SCORE and +1 to make sure the lowest value is 1
-		transTable.Put(P.Key3(), alpha - Position::MIN_SCORE + 1);
+		transTable.Put(key, alpha - Position::MIN_SCORE + 1);
 		return alpha;
 	}
 
-public:
-	TranspositionTable transTable;
-	OpeningBook book = OpeningBook(&transTable);
-
-	int Solve(const Position &P)
+	// Look for the exact score of a position in the knowledge store (book, warmup and previous solves)
+	bool KnownScore(const Position &P, int &score) const
 	{
-		if (transTable.Get(P.Key3()) != 0)
+		if (!Knowable(P))
+			return false;
+		if (uint8_t val = knowledge.Get(P.Key3(), P.nbMoves()))
 		{
-			return int(transTable.Get(P.Key3())) + Position::MIN_SCORE - 1;
+			score = val + Position::MIN_SCORE - 1;
+			return true;
 		}
-		if (P.CanWinNext()) // check if win in one move as the Negamax function does not support this case.
-			return (Position::WIDTH * Position::HEIGHT + 1 - P.nbMoves()) / 2;
+		return false;
+	}
 
-		int min = -(Position::WIDTH * Position::HEIGHT - P.nbMoves()) / 2;
-		int max = (Position::WIDTH * Position::HEIGHT + 1 - P.nbMoves()) / 2;
+	// Only the scores of normal boards are looked up in the knowledge store and learned: the book and the warmup
+	// come from normal games, and a board with hidden cells has the Key3() of the same stones on a normal board
+	static bool Knowable(const Position &P)
+	{
+		return !P.GetBlockedMask();
+	}
 
+	// Narrow down the [min;max] window by splitting it in half, slightly biased towards 0
+	int Bisection(const Position &P, int min, int max)
+	{
 		while (min < max)
 		{ // iteratively narrow the min-max exploration window
 			int med = min + (max - min) / 2;
@@ -113,76 +155,341 @@ public:
 			else if (med >= 0 && max / 2 > med)
 				med = max / 2;
 			int r = Negamax(P, med, med + 1); // use a null depth window to know if the actual score is greater or smaller than med
+			lastStats.probes++;
+			if (r <= med)
+				max = r;
+			else
+				min = r;
+		}
+		return min;
+	}
+
+	// MTD(f): probe right at the guess and move the guess to each returned bound, so a close guess only needs a couple of probes
+	int Mtdf(const Position &P, int min, int max, int guess)
+	{
+		guess = std::max(min, std::min(max, guess));
+		while (min < max)
+		{
+			int med = guess == min ? guess : guess - 1; // test "score > med", med must stay within [min;max-1]
+			int r = Negamax(P, med, med + 1);
+			lastStats.probes++;
 			if (r <= med)
 				max = r;
 			else
 				min = r;
+			guess = std::max(min, std::min(max, r));
 		}
 		return min;
 	}
 
-	int FindBestMove(const Position &P)
+	int SolveWindow(const Position &P, bool weak, int hint)
 	{
-		if (P.isEmpty())
-			return (Position::WIDTH + 1) / 2 - 1;
-		std::vector<int> best_cols;
-		int best_score = -100;
+		const unsigned long long start_nodes = nodeCount;
+		if (int score; KnownScore(P, score))
+			return weak ? (score > 0) - (score < 0) : score;
+		if (P.nbMoves() >= P.nbCells()) // no cell left to play
+			return 0;
+		if (P.CanWinNext()) // check if win in one move as the Negamax function does not support this case.
+			return weak ? 1 : (Position::WIDTH * Position::HEIGHT + 1 - P.nbMoves()) / 2;
+
+		int min = -(Position::WIDTH * Position::HEIGHT - P.nbMoves()) / 2;
+		int max = (Position::WIDTH * Position::HEIGHT + 1 - P.nbMoves()) / 2;
+		if (weak)
+		{
+			min = -1;
+			max = 1;
+		}
+
+		if (driver == SolveDriver::Mtdf && hint == NO_HINT)
+			hint = NeighbourHint(P);
+
+		// without any guess MTD(f) starting from 0 needs more nodes than the bisection
+		int score;
+		if (driver == SolveDriver::Mtdf && hint != NO_HINT)
+			score = Mtdf(P, min, max, hint);
+		else
+			score = Bisection(P, min, max);
+
+		if (weak)
+			return (score > 0) - (score < 0);
+
+		// the score is exact, save it so that solving the same position again is a single lookup
+		if (Knowable(P))
+			knowledge.Learn(P.Key3(), P.nbMoves(), score, nodeCount - start_nodes);
+		return score;
+	}
+
+	// Best known lower bound of the score of P from the exact scores of its children (book, warmup or previous solves)
+	int NeighbourHint(const Position &P) const
+	{
+		int hint = NO_HINT;
 		for (int col = 0; col < Position::WIDTH; ++col)
 		{
-			if (P.CanPlay(col))
+			if (!P.CanPlay(col))
+				continue;
+			Position P2(P);
+			P2.PlayCol(col);
+			if (int score; KnownScore(P2, score))
+				hint = std::max(hint, -score);
+		}
+		return hint;
+	}
+
+	// Score of a move searched by RootSearch(): exact for the best moves, an upper bound for the others
+	struct RootMove
+	{
+		int col;
+		int score;
+	};
+
+	// Null window test of a position, same bounds as Negamax(P, med, med + 1)
+	int Probe(const Position &P, int med, SolveStats &total)
+	{
+		total.probes++;
+		if (P.CanWinNext())
+			return (Position::WIDTH * Position::HEIGHT + 1 - P.nbMoves()) / 2;
+		return Negamax(P, med, med + 1);
+	}
+
+	/**
+	 * Principal variation search over the given columns of P: the most promising move is solved first, then every other move
+	 * is only tested with a null window against the best score so far. A move is solved exactly only if it beats that score.
+	 * Moves that are not searched before the budget runs out are put in unsearched.
+	 * @param: best_only, if true the search stops as soon as a move reaches the highest possible score
+	 * (the remaining moves could only tie with it), they are put in unsearched too.
+	 *
+	 * @return the searched moves, with their exact score if they are among the best moves or an upper bound otherwise
+	 */
+	std::vector<RootMove> RootSearch(const Position &P, const std::vector<int> &cols, bool weak, int hint,
+									 std::chrono::high_resolution_clock::time_point start, std::chrono::duration<double, std::milli> budget,
+									 bool best_only, SolveStats &total, std::vector<int> &unsearched)
+	{
+		// most promising moves first: exact scores already known, then moves creating the most winning spots
+		// (as in Negamax), the moves letting the opponent win right away go last
+		const uint64_t non_losing = P.PossibleNonLosingMoves();
+		std::vector<std::pair<int, int>> ordered; // (priority, col)
+		for (int i = 0; i < Position::WIDTH; ++i)
+		{
+			int col = columnOrder[i];
+			if (std::find(cols.begin(), cols.end(), col) == cols.end())
+				continue;
+			Position P2(P);
+			P2.PlayCol(col);
+			int priority, score;
+			if (KnownScore(P2, score))
+				priority = 1000 - score;
+			else if (P.MoveInCol(col) & non_losing)
+				priority = P.MoveScore(P.MoveInCol(col));
+			else
+				priority = -1;
+			ordered.push_back({priority, col});
+		}
+		std::stable_sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b)
+						 { return a.first > b.first; });
+
+		// highest score a move can get, when the best move reaches it the other ones only need to be tested once
+		const int max_score = weak ? 1 : (Position::WIDTH * Position::HEIGHT - 1 - P.nbMoves()) / 2;
+
+		std::vector<RootMove> moves;
+		int best = 0;
+		for (const auto &entry : ordered)
+		{
+			const int col = entry.second;
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+			if (elapsed >= budget || (best_only && !moves.empty() && best == max_score))
 			{
-				if (P.IsWinningMove(col))
-				{
-					return col;
-				}
-				Position P2(P);
-				P2.PlayCol(col);
-				int score = -Solve(P2);
-
-				if (score > best_score)
-				{
-					best_score = score;
-					best_cols.clear();
-					best_cols.push_back(col);
-				}
-				else if (score == best_score)
-				{
-					best_cols.push_back(col);
-				}
+				unsearched.push_back(col);
+				continue;
+			}
+
+			Position P2(P);
+			P2.PlayCol(col);
+			if (moves.empty())
+			{
+				best = -Solve(P2, weak, hint == NO_HINT ? NO_HINT : -hint);
+				total.probes += lastStats.probes;
+				moves.push_back({col, best});
+				continue;
+			}
+
+			int r = Probe(P2, -best, total); // is the move at least as good as the best one?
+			if (r > -best)
+			{
+				int bound = -r;
+				if (weak)
+					bound = std::max(-1, bound);
+				moves.push_back({col, bound});
+				continue;
+			}
+			if (best == max_score || Probe(P2, -best - 1, total) > -best - 1) // is it strictly better?
+			{
+				moves.push_back({col, best});
+				continue;
+			}
+			best = -Solve(P2, weak, -(best + 1));
+			total.probes += lastStats.probes;
+			moves.push_back({col, best});
+		}
+		return moves;
+	}
+
+public:
+	TranspositionTable &transTable;
+	KnowledgeStore &knowledge;
+
+	// Passed as a score hint when no guess of the score is known
+	static const int NO_HINT = std::numeric_limits<int>::min();
+
+	// Mask of allowed columns for Analyze(), bit i is set if column i may be played
+	static const unsigned int ALL_COLUMNS = (1u << Position::WIDTH) - 1;
+
+	/**
+	 * Compute the score of a position with iterative null window searches, using the current SolveDriver.
+	 * @param: weak, if true only the sign of the score is computed (win/draw/loss) by searching within the [-1;1] window,
+	 * which is much faster than narrowing down the exact distance to the end of the game
+	 * @param: hint, a guess of the score (e.g. the negated score of the parent or the score of the previous move in the game),
+	 * used as the first probe of the MTD(f) driver. Without a hint, exact scores of the children found in the table are used,
+	 * and if there are none the bisection is used instead.
+	 *
+	 * @return the exact score, or -1, 0, 1 (loss, draw, win) in weak mode
+	 */
+	int Solve(const Position &P, bool weak = false, int hint = NO_HINT)
+	{
+		const unsigned long long start_nodes = nodeCount;
+		lastStats.probes = 0;
+		lastStats.score = SolveWindow(P, weak, hint);
+		lastStats.nodes = nodeCount - start_nodes;
+		knowledge.Merge(knowledgeCounters);
+		return lastStats.score;
+	}
+
+	/**
+	 * Solve many positions at once, sharing the transposition table between them.
+	 * Duplicated positions (transpositions and symmetries included) are solved only once. The positions are solved from the
+	 * deepest to the shallowest and ordered by key inside a depth: an ancestor then finds the exact scores of its descendants
+	 * in the table, and positions solved one after the other share most of their subtrees.
+	 * @param: threads, number of solvers working on the batch at the same time, they all share the table of this solver
+	 *
+	 * @return the exact scores, in the same order as the input positions
+	 */
+	std::vector<int> SolveBatch(const std::vector<Position> &positions, unsigned int threads = 1)
+	{
+		std::vector<uint64_t> keys(positions.size());
+		std::vector<size_t> order(positions.size());
+		for (size_t i = 0; i < positions.size(); ++i)
+		{
+			keys[i] = positions[i].TableKey();
+			order[i] = i;
+		}
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+				  {
+					  if (positions[a].nbMoves() != positions[b].nbMoves())
+						  return positions[a].nbMoves() > positions[b].nbMoves();
+					  return keys[a] < keys[b]; });
+
+		std::vector<size_t> distinct; // first index of each distinct key, in solving order
+		for (size_t i : order)
+			if (distinct.empty() || keys[distinct.back()] != keys[i])
+				distinct.push_back(i);
+
+		std::vector<int> scores(positions.size());
+		std::atomic<size_t> next{0};
+		std::atomic<int> probes{0};
+		std::atomic<unsigned long long> nodes{0};
+		auto work = [&](Solver &solver)
+		{
+			for (size_t i = next++; i < distinct.size(); i = next++)
+			{
+				scores[distinct[i]] = solver.Solve(positions[distinct[i]]);
+				probes += solver.GetLastStats().probes;
+				nodes += solver.GetLastStats().nodes;
 			}
+		};
+
+		std::vector<std::unique_ptr<Solver>> workers;
+		std::vector<std::thread> pool;
+		for (unsigned int t = 1; t < threads; ++t)
+		{
+			workers.push_back(Fork());
+			pool.emplace_back(work, std::ref(*workers.back()));
 		}
+		work(*this);
+		for (std::thread &t : pool)
+			t.join();
+
+		for (size_t i = 1; i < order.size(); ++i)
+			if (keys[order[i]] == keys[order[i - 1]])
+				scores[order[i]] = scores[order[i - 1]];
+
+		for (const auto &worker : workers)
+			nodeCount += worker->GetNodeCount();
+		lastStats.score = 0;
+		lastStats.probes = probes;
+		lastStats.nodes = nodes;
+		return scores;
+	}
 
-		std::random_device rd;
-		std::mt19937 gen(rd());
-		std::uniform_int_distribution<> dist(0, best_cols.size() - 1);
-		return best_cols[dist(gen)];
+	int FindBestMove(const Position &P, bool weak = false, int hint = NO_HINT)
+	{
+		return Analyze(P, weak, std::chrono::duration<double, std::milli>::max(), hint, ALL_COLUMNS, true)[0][0];
 	}
 
-	std::vector<std::vector<int>> Analyze(const Position &P)
+	/**
+	 * Rank all the playable columns of a position, from the best group of moves to the worst one.
+	 * Moves with equal scores are shuffled inside their group.
+	 * The moves are searched with a principal variation search: only the best moves get an exact score,
+	 * the other ones are ranked by the upper bound proven when testing them against the best score.
+	 * @param: weak, if true the children are first classified as win/draw/loss with a weak solve, then only the
+	 * tied winning moves are refined with an exact search (to find the quickest win) as long as refine_budget allows.
+	 * Winning moves that could not be refined in time are ranked right after the refined ones.
+	 * @param: hint, a guess of the score of P, used to seed the solve of the most promising child.
+	 * @param: allowed_cols, mask of the columns that may be played (e.g. the valid moves of the platform without the columns
+	 * whose next cell is hidden), the other columns are neither searched nor ranked.
+	 * @param: best_only, if true the search stops once a move is proven to reach the highest possible score, the moves left
+	 * are ranked last. Use it when only the first move of the ranking matters.
+	 *
+	 * After the call, GetLastStats() holds the score of P (among the allowed moves) and the probes and nodes of the whole search.
+	 */
+	std::vector<std::vector<int>> Analyze(const Position &P, bool weak = false,
+										  std::chrono::duration<double, std::milli> refine_budget = std::chrono::duration<double, std::milli>::max(),
+										  int hint = NO_HINT, unsigned int allowed_cols = ALL_COLUMNS, bool best_only = false)
 	{
 		// Simulate a timeout move
 		// std::this_thread::sleep_for(std::chrono::seconds(10));
 		// return {{3}, {1,4}, {0, 6, 2, 5}};
 
+		auto start = std::chrono::high_resolution_clock::now();
+
 		std::vector<std::vector<int>> ranked_moves;
 		std::map<int, std::vector<int>, std::greater<>> score_to_cols;
 
 		std::random_device rd;
 		std::mt19937 g(rd());
 
-		if (P.isEmpty())
+		SolveStats total;
+		const unsigned long long start_nodes = nodeCount;
+
+		if (P.isEmpty() && (allowed_cols >> ((Position::WIDTH + 1) / 2 - 1) & 1))
 		{
 			int middle_col = (Position::WIDTH + 1) / 2 - 1;
 			ranked_moves.push_back({middle_col});
+			// the empty board is not searched, its score is only known from the book
+			KnownScore(P, total.score);
+			lastStats = total;
 			return ranked_moves;
 		}
 
 		std::vector<int> winning_cols;
+		std::vector<int> playable_cols;
+		bool excluded_cols = false;
 		for (int col = 0; col < Position::WIDTH; ++col)
 		{
-			if (P.CanPlay(col) && P.IsWinningMove(col))
+			excluded_cols |= P.CanPlay(col) && !(allowed_cols >> col & 1);
+			if (P.CanPlay(col) && (allowed_cols >> col & 1))
 			{
-				winning_cols.push_back(col);
+				playable_cols.push_back(col);
+				if (P.IsWinningMove(col))
+					winning_cols.push_back(col);
 			}
 		}
 
@@ -190,28 +497,61 @@ public:
 		{
 			std::shuffle(winning_cols.begin(), winning_cols.end(), g);
 			ranked_moves.push_back(winning_cols);
+			total.score = (Position::WIDTH * Position::HEIGHT + 1 - P.nbMoves()) / 2;
+			lastStats = total;
 			return ranked_moves;
 		}
 
-		for (int col = 0; col < Position::WIDTH; ++col)
+		std::vector<int> unsearched;
+		for (const RootMove &m : RootSearch(P, playable_cols, weak, hint, start, std::chrono::duration<double, std::milli>::max(), best_only, total, unsearched))
+			score_to_cols[m.score].push_back(m.col);
+
+		std::vector<int> unrefined_cols;
+		if (weak && !score_to_cols.empty() && score_to_cols.begin()->first > 0 && score_to_cols.begin()->second.size() > 1)
 		{
-			if (P.CanPlay(col))
-			{
-				Position P2(P);
-				P2.PlayCol(col);
-				int score = -Solve(P2);
+			std::vector<int> tied_cols = std::move(score_to_cols.begin()->second);
+			score_to_cols.erase(score_to_cols.begin());
 
-				score_to_cols[score].push_back(col);
-			}
+			for (const RootMove &m : RootSearch(P, tied_cols, false, hint, start, refine_budget, best_only, total, unrefined_cols))
+				score_to_cols[m.score].push_back(m.col);
 		}
 
+		// the score of P is the one of its best group of moves (a weak win if no winning move could be refined in time)
+		if (!unrefined_cols.empty() && (score_to_cols.empty() || score_to_cols.begin()->first <= 0))
+			total.score = 1;
+		else if (!score_to_cols.empty())
+			total.score = score_to_cols.begin()->first;
+
+		// the score is exact when every move was searched strongly, remember it for the next time P is analyzed
+		if (!weak && !excluded_cols && !score_to_cols.empty() && Knowable(P))
+			knowledge.Learn(P.Key3(), P.nbMoves(), total.score, nodeCount - start_nodes);
+
 		for (const auto &entry : score_to_cols)
 		{
+			if (!unrefined_cols.empty() && entry.first <= 0)
+			{
+				std::shuffle(unrefined_cols.begin(), unrefined_cols.end(), g);
+				ranked_moves.push_back(unrefined_cols);
+				unrefined_cols.clear();
+			}
 			std::vector<int> cols = entry.second;
 			std::shuffle(cols.begin(), cols.end(), g);
 			ranked_moves.push_back(cols);
 		}
+		if (!unrefined_cols.empty())
+		{
+			std::shuffle(unrefined_cols.begin(), unrefined_cols.end(), g);
+			ranked_moves.push_back(unrefined_cols);
+		}
+		if (!unsearched.empty())
+		{
+			std::shuffle(unsearched.begin(), unsearched.end(), g);
+			ranked_moves.push_back(unsearched);
+		}
 
+		total.nodes = nodeCount - start_nodes;
+		lastStats = total;
+		knowledge.Merge(knowledgeCounters);
 		return ranked_moves;
 	}
 
@@ -228,10 +568,35 @@ public:
 		return nodeCount;
 	}
 
+	const SolveStats &GetLastStats() const
+	{
+		return lastStats;
+	}
+
+	void SetDriver(SolveDriver d)
+	{
+		driver = d;
+	}
+
+	// Make the search call throttle->Checkpoint() regularly (nullptr to search at full speed)
+	void SetThrottle(SearchThrottle *t)
+	{
+		throttle = t;
+	}
+
+	// A new solver sharing the table, the knowledge and the settings of this one, to search on another thread
+	std::unique_ptr<Solver> Fork() const
+	{
+		auto solver = std::make_unique<Solver>(sharedTable, sharedKnowledge);
+		solver->driver = driver;
+		solver->throttle = throttle;
+		return solver;
+	}
+
 	void LoadBook()
 	{
 		auto start = std::chrono::high_resolution_clock::now();
-		book.load(OPENING_BOOK_PATH);
+		knowledge.LoadBook(OPENING_BOOK_PATH);
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double, std::milli> duration = end - start;
 		std::cout << "Opening book loaded: " << duration.count() / 1000 << " seconds.\n";
@@ -241,23 +606,21 @@ public:
 	void Warmup()
 	{
 		auto start = std::chrono::high_resolution_clock::now();
-		std::string line;
-		std::string move;
-		int score;
-		int count = 0;
-		std::ifstream ifs(WARMUP_BOOK_PATH);
-		while (getline(ifs, line))
-		{
-			std::istringstream iss(line);
-			iss >> move >> score;
-			Position P;
-			P.Play(move);
-			transTable.Put(P.Key3(), uint8_t(score - Position::MIN_SCORE + 1));
-			count++;
-		}
+		const size_t count = knowledge.LoadWarmup(WARMUP_BOOK_PATH, WARMUP_BINARY_PATH);
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<double, std::milli> duration = end - start;
-		std::cout << "Warmup complete: " << duration.count() / 1000 << " seconds.\n";
+		std::cout << "Warmup complete: " << count << " positions in " << duration.count() / 1000 << " seconds.\n";
+		std::cout.flush();
+	}
+
+	// Reload the positions solved by previous runs, and journal the new solves of at least min_nodes nodes
+	void OpenJournal(unsigned long long min_nodes)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		const size_t count = knowledge.OpenJournal(JOURNAL_PATH, min_nodes);
+		auto end = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double, std::milli> duration = end - start;
+		std::cout << "Journal loaded: " << count << " positions in " << duration.count() / 1000 << " seconds.\n";
 		std::cout.flush();
 	}
 
@@ -279,9 +642,16 @@ public:
 		transTable.Reset();
 	}
 
-	Solver() : nodeCount{0}, transTable(67108879) // 2^26 entries, ~1GB in RAM
+	Solver() : Solver(std::make_shared<TranspositionTable>(67108879)) // 2^26 entries, ~512MB in RAM
+	{
+	}
+
+	// Create a solver searching with an existing table (and knowledge), e.g. to solve positions on several threads
+	explicit Solver(std::shared_ptr<TranspositionTable> table, std::shared_ptr<KnowledgeStore> knowledge_store = nullptr)
+		: nodeCount{0}, driver{SolveDriver::Mtdf}, sharedTable(std::move(table)),
+		  sharedKnowledge(knowledge_store ? std::move(knowledge_store) : std::make_shared<KnowledgeStore>()),
+		  transTable(*sharedTable), knowledge(*sharedKnowledge)
 	{
-		Reset();
 		for (int i = 0; i < Position::WIDTH; i++)
 			columnOrder[i] = Position::WIDTH / 2 + (1 - 2 * (i % 2)) * (i + 1) / 2;
 		// initialize the column exploration order, starting with center columns
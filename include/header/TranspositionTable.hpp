@@ -1,58 +1,153 @@
 #pragma once
 
 #include <vector>
-#include <cstring>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstddef>
 
+/**
+ * Open addressing hash table (linear probing) from position keys to 8 bits values.
+ * Each entry packs the key and the value in a single 64 bits word, so that several solvers running on different
+ * threads can share the same table without locks: an entry is always read and written as a whole.
+ * Keys must therefore fit in 56 bits, as Position::TableKey() does: a key is stored whole, so two positions never
+ * share an entry.
+ */
 class TranspositionTable
 {
 private:
-	struct Entry
-	{
-		uint64_t key;
-		uint8_t val;
-	};
+	static const int VALUE_BITS = 8;
+	static const uint64_t KEY_MASK = (UINT64_C(1) << (64 - VALUE_BITS)) - 1;
+	static const size_t PREFETCH_DISTANCE = 16; // entries ahead whose slot is prefetched by PutBatch()
+	static const size_t MAX_REGIONS = 4096;		// regions of the table PutBatch() sorts the entries into
 
-	std::vector<Entry> T;
+	std::vector<std::atomic<uint64_t>> T;
 
-	unsigned int index(const uint64_t key) const
+	size_t index(const uint64_t key) const
 	{
 		return key % T.size();
 	}
 
+	// insert a key, starting the linear probing at slot i, return true if the key was not in the table
+	bool PutAt(size_t i, const uint64_t key, const uint8_t val)
+	{
+		const uint64_t entry = key << VALUE_BITS | val;
+		while (true)
+		{
+			uint64_t current = T[i].load(std::memory_order_relaxed);
+			if (current == 0)
+			{
+				if (T[i].compare_exchange_weak(current, entry, std::memory_order_relaxed))
+					return true;
+				continue; // another thread took the slot, check it again
+			}
+			if (current >> VALUE_BITS == key)
+			{
+				T[i].store(entry, std::memory_order_relaxed);
+				return false;
+			}
+			i = (i + 1) % T.size();
+			collisions.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
 public:
-	int collisions = 0;
+	std::atomic<unsigned long long> collisions{0};
 
-	TranspositionTable(const unsigned int size) : T(size)
+	TranspositionTable(const size_t size) : T(size)
 	{
 		assert(size > 0);
 	}
 
 	void Reset()
 	{
-		memset(&T[0], 0, T.size() * sizeof(Entry));
+		for (auto &entry : T)
+			entry.store(0, std::memory_order_relaxed);
+		collisions = 0;
 	}
 
 	void Put(const uint64_t key, const uint8_t val)
 	{
-		unsigned int i = index(key);
-		while (T[i].key != 0 && T[i].key != key)
+		assert(key <= KEY_MASK);
+		PutAt(index(key), key, val);
+	}
+
+	/**
+	 * Insert many entries at once, with the same result as calling Put() on each of them in order.
+	 * The entries are first grouped by region of the table, with a stable counting sort into few enough regions for
+	 * its counters to stay in cache. Each region is then filled in turn: its slots stay in cache and TLB while it is
+	 * filled, and the slots of the next entries are prefetched. The regions are split between the threads: all the
+	 * entries of a key start their probing at the same slot, so they are still inserted in order by one thread.
+	 * @param: entries, the (key, value) pairs to insert, keys of 56 bits as in Put()
+	 * @param: threads, number of threads inserting at the same time
+	 * @return the number of keys that were not in the table
+	 */
+	size_t PutBatch(const std::vector<std::pair<uint64_t, uint8_t>> &entries, unsigned int threads = 1)
+	{
+		struct Slotted
 		{
-			i = (i + 1) % T.size();
-			collisions++;
+			uint64_t slot;
+			uint64_t entry; // key << VALUE_BITS | value
+		};
+
+		// regions of 2^shift slots, 256KB of the table or more, so that there are less than MAX_REGIONS of them
+		int shift = 15;
+		while ((T.size() >> shift) >= MAX_REGIONS)
+			shift++;
+		const size_t regions = (T.size() >> shift) + 1;
+
+		std::vector<size_t> starts(regions + 1, 0);
+		for (const auto &e : entries)
+		{
+			assert(e.first <= KEY_MASK);
+			starts[(index(e.first) >> shift) + 1]++;
 		}
-		T[i].key = key;
-		T[i].val = val;
+		for (size_t r = 0; r < regions; r++)
+			starts[r + 1] += starts[r];
+		std::vector<Slotted> sorted(entries.size());
+		{
+			std::vector<size_t> next(starts.begin(), starts.end() - 1);
+			for (const auto &e : entries)
+			{
+				const size_t slot = index(e.first);
+				sorted[next[slot >> shift]++] = {slot, e.first << VALUE_BITS | e.second};
+			}
+		}
+
+		threads = std::max(1u, std::min(threads, unsigned(regions)));
+		std::atomic<size_t> added{0};
+		auto insert = [&](const unsigned int t)
+		{
+			size_t count = 0;
+			const size_t end = starts[regions * (t + 1) / threads];
+			for (size_t i = starts[regions * t / threads]; i < end; i++)
+			{
+				if (i + PREFETCH_DISTANCE < end)
+					__builtin_prefetch(&T[sorted[i + PREFETCH_DISTANCE].slot], 1);
+				count += PutAt(sorted[i].slot, sorted[i].entry >> VALUE_BITS, uint8_t(sorted[i].entry));
+			}
+			added += count;
+		};
+		std::vector<std::thread> pool;
+		for (unsigned int t = 1; t < threads; t++)
+			pool.emplace_back(insert, t);
+		insert(0);
+		for (std::thread &t : pool)
+			t.join();
+		return added;
 	}
 
 	uint8_t Get(const uint64_t key) const
 	{
-		unsigned int i = index(key);
-		while (T[i].key != 0)
+		assert(key <= KEY_MASK);
+		size_t i = index(key);
+		while (uint64_t current = T[i].load(std::memory_order_relaxed))
 		{
-			if (T[i].key == key)
-				return T[i].val;
+			if (current >> VALUE_BITS == key)
+				return uint8_t(current);
 			i = (i + 1) % T.size();
 		}
 		return 0;
@@ -63,13 +158,15 @@ public:
 		return T.size();
 	}
 
-	const uint64_t *GetKeys() const
+	// Key stored in the i-th slot of the table (0 if the slot is empty)
+	uint64_t GetKey(const size_t i) const
 	{
-		return reinterpret_cast<const uint64_t *>(&T[0]);
+		return T[i].load(std::memory_order_relaxed) >> VALUE_BITS;
 	}
 
-	const uint8_t *GetValues() const
+	// Value stored in the i-th slot of the table (0 if the slot is empty)
+	uint8_t GetValue(const size_t i) const
 	{
-		return &T[0].val;
+		return uint8_t(T[i].load(std::memory_order_relaxed));
 	}
 };
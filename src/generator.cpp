@@ -1,8 +1,22 @@
 #include "header/Position.hpp"
 #include "header/Solver.hpp"
 #include "header/OpeningBook.hpp"
+#include "header/ExternalSorter.hpp"
+#include "header/OrderedPipeline.hpp"
+#include "header/Crc32.hpp"
+#include "header/KeySet.hpp"
+#include "header/MappedFile.hpp"
+
+#include <cstddef>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
-#include <unordered_set>
 /**
  * How to use the generator to generate an opening book:
  *
@@ -12,31 +26,37 @@
  *
  * After that, run the calculateScore() function, which will take your moves file, calculate
  * the score of each moves, then saved all of the scores to an output file (I'll call it results.txt).
- * Run: make generate ARGS="moves_explored.txt results.txt"
+ * Run: make generate ARGS="moves_explored.txt results.txt" (add a number of threads at the end to solve on several cores)
  * Note: this step may take a very long time, if you terminate the program while it's running, it
  * will automatically continue from where you left, so don't worry :3
+ * (the progress is saved every 10 seconds to results.txt.ckpt, keep it next to results.txt)
+ * The positions of the opening book of data/, if there is one, are looked up instead of searched: with the depth 12
+ * book, the scores of depth 13 only cost the searches of the last layer.
+ * To use several processes (e.g. for depths beyond 12): make generate ARGS="shard moves_explored.txt results.txt 4",
+ * it also continues from where it left.
+ * Or, to only search the deepest positions and derive the others from their children:
+ * make generate ARGS="retro moves_explored.txt results.txt [threads] [memory_MB]" (the layers are sorted on disk
+ * next to results.txt with at most memory_MB, 1024 by default)
  *
- * When you've got the results.txt file, put it into the project's directory, then the AI should run
- * correctly with "make run..."
+ * When you've got the results.txt file, turn it into the binary book read by the AI:
+ * make generate ARGS="book results.txt" (add a memory budget in MB at the end, 1024 by default: bigger files are
+ * sorted on disk next to the book), then the AI should run correctly with "make run..."
  * 
  * The repo already has a sample opening book, which is named "data/depth_12_scores_7x6.book", it is the results
  * file after running explore and calculateScore with depth 13.
  */
-void explore(const Position &P, char *pos_str, std::unordered_set<uint64_t> &visited,
-             int &number_of_explored_moves, const int depth, std::ofstream &explored_moves_stream)
+/**
+ * Append to out the positions of the subtree of P (P included) of at most depth moves that are not in visited yet,
+ * one line of moves per position in DFS order, and add them to visited. Winning moves are not followed.
+ * @param: moves, the moves leading to P, restored when the function returns
+ */
+void explore(const Position &P, std::string &moves, KeySet &visited, std::string &out, const int depth)
 {
-    uint64_t key = P.Key3();
-    if (!visited.insert(key).second)
+    if (!visited.Insert(P.Key3()))
         return;
-
-    int nb_moves = P.nbMoves();
-    if (nb_moves <= depth)
-    {
-
-        explored_moves_stream << pos_str << std::endl;
-        number_of_explored_moves++;
-    }
-    if (nb_moves > depth)
+    out += moves;
+    out += '\n';
+    if (P.nbMoves() >= depth)
         return;
 
     for (int i = 0; i < Position::WIDTH; i++)
@@ -44,82 +64,833 @@ void explore(const Position &P, char *pos_str, std::unordered_set<uint64_t> &vis
         {
             Position P2(P);
             P2.PlayCol(i);
-            pos_str[nb_moves] = '1' + i;
-            explore(P2, pos_str, visited, number_of_explored_moves, depth, explored_moves_stream);
-            pos_str[nb_moves] = 0;
+            moves.push_back('1' + i);
+            explore(P2, moves, visited, out, depth);
+            moves.pop_back();
         }
 }
 
-void calculateScore(char *input_file, char *result_file)
+/**
+ * Write to a file every position of at most depth moves (transpositions and mirror images once), in DFS order.
+ * The positions of SPLIT_DEPTH moves are expanded by several threads sharing the visited set, and their subtrees
+ * are written in the order of a single-threaded walk. The set of positions does not depend on the number of threads,
+ * only the moves written for a transposition reached from two subtrees at once may.
+ * @return the number of positions written, -1 on error
+ */
+long long explorePositions(const int depth, const std::string &filename, unsigned int threads = 0)
 {
-    auto start = std::chrono::high_resolution_clock::now();
+    // number of positions after n moves (OEIS A212693), the mirror images are counted twice
+    static const uint64_t POSITIONS[] = {1, 7, 49, 238, 1120, 4263, 16422, 54859, 184275, 558186, 1662623, 4568683,
+                                         12236101, 30929111, 75437595, 176541259, 394591391, 858218743, 1763883894};
+    const int MAX_DEPTH = sizeof(POSITIONS) / sizeof(POSITIONS[0]) - 1;
+    const int SPLIT_DEPTH = 4;
+    if (depth < 0 || depth > MAX_DEPTH)
+    {
+        std::cerr << "Invalid depth! (at most " << MAX_DEPTH << ")";
+        return -1;
+    }
+    uint64_t positions = 0;
+    for (int n = 0; n <= depth; n++)
+        positions += POSITIONS[n];
+    KeySet visited(positions / 2 + positions / 16);
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
 
-    std::string line;
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+    {
+        std::cerr << "Error: Can't open file " << filename << "\n";
+        return -1;
+    }
+
+    // the top of the tree, walked first
+    std::string top, moves;
+    explore(Position(), moves, visited, top, std::min(depth, SPLIT_DEPTH));
+    std::istringstream top_lines(top);
 
-    int lines_done = 0;
-    std::ifstream input(result_file);
-    while (getline(input, line) && !line.empty())
+    long long count = 0;
+    std::atomic<bool> full{false}; // set by any of the workers whose subtree overflows the visited set
+    RunOrdered<std::string, std::string>(
+        threads, 16 * threads,
+        [&](std::string &line)
+        {
+            return bool(getline(top_lines, line));
+        },
+        [&](unsigned int, const std::string &line)
+        {
+            std::string subtree = line + "\n", moves = line;
+            Position P;
+            P.Play(line);
+            if (P.nbMoves() == SPLIT_DEPTH && depth > SPLIT_DEPTH)
+            {
+                try
+                {
+                    for (int i = 0; i < Position::WIDTH; i++)
+                        if (P.CanPlay(i) && !P.IsWinningMove(i))
+                        {
+                            Position P2(P);
+                            P2.PlayCol(i);
+                            moves.push_back('1' + i);
+                            explore(P2, moves, visited, subtree, depth);
+                            moves.pop_back();
+                        }
+                }
+                catch (const std::overflow_error &)
+                {
+                    full = true;
+                }
+            }
+            return subtree;
+        },
+        [&](const std::string &subtree)
+        {
+            out.write(subtree.data(), subtree.size());
+            count += std::count(subtree.begin(), subtree.end(), '\n');
+        });
+    out.close();
+
+    if (full || !out)
     {
-        lines_done++;
+        std::cerr << (full ? "Error: more positions than expected" : "Error: Can't write file " + filename) << "\n";
+        return -1;
     }
-    input.close();
+    return count;
+}
 
-    std::ifstream moves_file(input_file);
+/**
+ * Replace a file at once by the file written aside to <filename>.tmp, synced to the disk first: whenever the
+ * program is stopped, the file is either the previous one or the complete new one.
+ * @param: out, the file written aside, closed by the call
+ */
+bool replaceFile(std::FILE *out, const std::string &filename)
+{
+    const std::string tmp = filename + ".tmp";
+    bool ok = !std::ferror(out) && std::fflush(out) == 0;
+#ifndef _WIN32
+    ok = ok && fsync(fileno(out)) == 0;
+#endif
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok)
+    {
+        std::cerr << "Error: Can't write file " << tmp << "\n";
+        std::remove(tmp.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    std::remove(filename.c_str()); // rename does not replace an existing file there
+#endif
+    return std::rename(tmp.c_str(), filename.c_str()) == 0;
+}
+
+/**
+ * Progress of calculateScore(), saved to <result_file>.ckpt: the results file is valid up to results_size bytes,
+ * which hold the scores of the moves file up to input_offset bytes.
+ * The results are synced to the disk before the checkpoint is written, and the checkpoint replaces the previous
+ * one at once (written aside then renamed), so whenever the program is stopped the last checkpoint is consistent.
+ */
+struct ScoreCheckpoint
+{
+    uint64_t input_offset;
+    uint64_t results_size;
+    uint64_t lines;
+    uint32_t crc; // of the fields above
+    uint32_t reserved;
+};
+
+bool readCheckpoint(const std::string &filename, ScoreCheckpoint &checkpoint)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    return ifs.read(reinterpret_cast<char *>(&checkpoint), sizeof(checkpoint)) &&
+           checkpoint.crc == Crc32(&checkpoint, offsetof(ScoreCheckpoint, crc));
+}
+
+void writeCheckpoint(const std::string &filename, ScoreCheckpoint checkpoint)
+{
+    checkpoint.crc = Crc32(&checkpoint, offsetof(ScoreCheckpoint, crc));
+    checkpoint.reserved = 0;
+    const std::string tmp = filename + ".tmp";
+    std::FILE *out = std::fopen(tmp.c_str(), "wb");
+    if (!out)
+    {
+        std::cerr << "Error: Can't open file " << tmp << "\n";
+        return;
+    }
+    std::fwrite(&checkpoint, sizeof(checkpoint), 1, out);
+    replaceFile(out, filename);
+}
+
+/**
+ * Find where to resume scoring: from the checkpoint if there is one, else (results written before checkpoints
+ * existed) from the complete lines of the results file. The results file is cut to the resume point, dropping
+ * the lines written after the last checkpoint and a line torn by a crash.
+ */
+ScoreCheckpoint resumePoint(const std::string &input_file, const std::string &result_file, const std::string &checkpoint_file)
+{
+    ScoreCheckpoint checkpoint{};
+    std::error_code error;
+    const uint64_t results_size = std::filesystem::exists(result_file, error) ? std::filesystem::file_size(result_file, error) : 0;
+    if (!readCheckpoint(checkpoint_file, checkpoint) || checkpoint.results_size > results_size)
+    {
+        checkpoint = {};
+        std::ifstream results(result_file, std::ios::binary);
+        std::ifstream moves(input_file, std::ios::binary);
+        for (std::string line; getline(results, line) && !line.empty() && !results.eof(); checkpoint.lines++)
+        {
+            checkpoint.results_size += line.size() + 1;
+            getline(moves, line);
+            checkpoint.input_offset += line.size() + 1;
+        }
+    }
+    if (results_size > checkpoint.results_size)
+        std::filesystem::resize_file(result_file, checkpoint.results_size, error);
+    return checkpoint;
+}
+
+// Look up the positions of the opening book of data/ instead of searching them, if there is one
+void loadBook(Solver &solver)
+{
+    std::error_code error;
+    if (std::filesystem::exists(OPENING_BOOK_PATH, error))
+        solver.LoadBook();
+}
+
+void calculateScore(char *input_file, char *result_file, unsigned int threads = 1)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    const std::string checkpoint_file = std::string(result_file) + ".ckpt";
+    ScoreCheckpoint checkpoint = resumePoint(input_file, result_file, checkpoint_file);
+
+    std::ifstream moves_file(input_file, std::ios::binary);
     if (!moves_file)
     {
         std::cerr << "Invalid moves file!";
         return;
     }
-    std::ofstream moves_with_scores(result_file, std::ios::app);
-    if (!result_file)
+    std::FILE *moves_with_scores = std::fopen(result_file, "ab");
+    if (!moves_with_scores)
     {
         std::cerr << "Invalid results file!";
         return;
     }
+    moves_file.seekg(checkpoint.input_offset);
+    if (checkpoint.lines > 0)
+        std::cout << "Resuming after " << checkpoint.lines << " lines\n";
 
-    for (int i = 1; i <= lines_done; i++)
+    // the scores written so far, made durable before being recorded in a checkpoint
+    auto saveCheckpoint = [&]()
     {
-        getline(moves_file, line);
-    }
+        std::fflush(moves_with_scores);
+#ifndef _WIN32
+        fsync(fileno(moves_with_scores));
+#endif
+        writeCheckpoint(checkpoint_file, checkpoint);
+    };
 
+    // Positions next to each other in the file are closely related (explore() writes them in DFS order),
+    // so they are handed to the workers by chunks solved with SolveBatch: a chunk is solved deepest first,
+    // each position finding the scores of its descendants in the table. The workers share the table and
+    // take a new chunk as soon as they are done, the results are written in the order of the input file.
+    // Reordering the file further does not pay: solving 1500 positions of 10 to 12 moves in file order, deepest
+    // first as a single batch, or shuffled takes the same number of nodes within 2%. explore() already keeps a
+    // single line per transposition, and the table holds the subtrees of far more positions than a chunk.
+    const size_t CHUNK_SIZE = 64;
     Solver solver;
+    loadBook(solver);
+    std::vector<std::unique_ptr<Solver>> workers;
+    for (unsigned int t = 0; t < threads; ++t)
+        workers.push_back(solver.Fork());
 
     const int CHECK_PERIOD = 10;
-    int count = 0;
+    long long count = 0;
     int next_time = CHECK_PERIOD;
 
-    while (getline(moves_file, line))
+    // a chunk of consecutive lines, and the offset in the moves file of the end of the chunk
+    using Chunk = std::pair<std::vector<std::string>, uint64_t>;
+    std::string line;
+    uint64_t input_offset = checkpoint.input_offset;
+
+    RunOrdered<Chunk, Chunk>(
+        threads, 16 * threads,
+        [&](Chunk &chunk)
+        {
+            while (chunk.first.size() < CHUNK_SIZE && getline(moves_file, line))
+            {
+                input_offset += line.size() + 1;
+                chunk.first.push_back(line);
+            }
+            chunk.second = input_offset;
+            return !chunk.first.empty();
+        },
+        [&](unsigned int worker, const Chunk &chunk)
+        {
+            const std::vector<std::string> &lines = chunk.first;
+            std::vector<Position> positions(lines.size());
+            for (size_t i = 0; i < lines.size(); ++i)
+                positions[i].Play(lines[i]);
+            std::vector<int> scores = workers[worker]->SolveBatch(positions);
+
+            Chunk results{std::vector<std::string>(lines.size()), chunk.second};
+            for (size_t i = 0; i < lines.size(); ++i)
+                results.first[i] = lines[i] + " " + std::to_string(scores[i]) + "\n";
+            return results;
+        },
+        [&](const Chunk &results)
+        {
+            for (const std::string &result : results.first)
+            {
+                std::fwrite(result.data(), 1, result.size(), moves_with_scores);
+                checkpoint.results_size += result.size();
+            }
+            checkpoint.lines += results.first.size();
+            checkpoint.input_offset = results.second;
+            count += results.first.size();
+
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double, std::milli> duration = end - start;
+
+            double time_elapsed = duration.count() / 1000;
+            if (time_elapsed >= next_time)
+            {
+                std::cout << "Time elapsed: " << duration.count() / 1000 << " seconds, " << count << " lines processed\n";
+                next_time += CHECK_PERIOD;
+                saveCheckpoint();
+            }
+        });
+    saveCheckpoint();
+    std::fclose(moves_with_scores);
+}
+
+/**
+ * Split a moves file in shards of consecutive lines (consecutive lines share most of their subtrees),
+ * shard k being written to <result_file>.shard<k>.moves. Each shard is written aside then renamed, and
+ * <result_file>.shards (holding the number of shards) is only written once all of them are complete: a split
+ * stopped before is done again, while a complete one is kept with the results of its shards.
+ */
+bool splitMoves(const std::string &input_file, const std::string &result_file, const int shards)
+{
+    const std::string marker = result_file + ".shards";
+    int split_shards = 0;
+    if (std::ifstream(marker) >> split_shards)
     {
-        Position P;
-        P.Play(line);
-        int score = solver.Solve(P);
+        if (split_shards == shards)
+            return true;
+        std::cerr << "Error: " << input_file << " is already split in " << split_shards << " shards, continue with "
+                  << split_shards << " processes or remove " << marker << " to start over\n";
+        return false;
+    }
+
+    std::ifstream in(input_file);
+    if (!in)
+    {
+        std::cerr << "Invalid moves file!";
+        return false;
+    }
+    // every line is a position, the empty one written first by explore() being the root
+    long long lines = 0;
+    for (std::string line; getline(in, line);)
+        lines++;
+    if (lines == 0)
+    {
+        std::cerr << "Error: No position in " << input_file << "\n";
+        return false;
+    }
+    in.clear();
+    in.seekg(0);
+
+    std::string line;
+    for (int k = 0; k < shards; k++)
+    {
+        // results left by a split that was not completed do not belong to these shards
+        const std::string shard = result_file + ".shard" + std::to_string(k);
+        std::remove(shard.c_str());
+        std::remove((shard + ".ckpt").c_str());
+
+        std::FILE *out = std::fopen((shard + ".moves.tmp").c_str(), "wb");
+        if (!out)
+        {
+            std::cerr << "Error: Can't write the shards of " << input_file << "\n";
+            return false;
+        }
+        for (long long i = lines * k / shards; i < lines * (k + 1) / shards && getline(in, line); i++)
+        {
+            std::fwrite(line.data(), 1, line.size(), out);
+            std::fputc('\n', out);
+        }
+        if (!replaceFile(out, shard + ".moves"))
+            return false;
+    }
 
-        moves_with_scores << line << " " << score << "\n";
-        count++;
+    std::FILE *out = std::fopen((marker + ".tmp").c_str(), "wb");
+    if (!out)
+    {
+        std::cerr << "Error: Can't open file " << marker << ".tmp\n";
+        return false;
+    }
+    std::fprintf(out, "%d\n", shards);
+    return replaceFile(out, marker);
+}
 
-        auto end = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double, std::milli> duration = end - start;
+/**
+ * Score a moves file with several processes: the file is split in shards, each shard is scored by a child
+ * process (this program with the arguments of calculateScore()) with its own table and results file, and a shard
+ * whose process dies is restarted, resuming from its results file. Once every shard is done, their results are
+ * concatenated to result_file in the order of the moves file, ready for generateOpeningBook().
+ * Each process allocates its own table (~512MB), so the number of processes is bounded by the memory too.
+ * <result_file>.lock is locked while the shards are scored, and the shard processes inherit the lock: a new run
+ * refuses to start until the processes of a stopped run (e.g. killed with their parent still running) are gone.
+ * It holds the pids of the running processes.
+ * @param: program, path of this program (argv[0])
+ * @param: threads, number of threads of each process
+ * @return false if the moves could not be split, a shard failed or the results could not be merged
+ */
+bool calculateScoreSharded(const char *program, const std::string &input_file, const std::string &result_file,
+                           const int shards, const int threads)
+{
+#ifdef _WIN32
+    std::cerr << "Sharded scoring needs fork(), use the threads of calculateScore() instead\n";
+    return false;
+#else
+    const int MAX_RESTARTS = 3; // consecutive failures of a shard before giving up on it
+
+    // not closed on exec, so that the shard processes hold the lock until the last one exits
+    const std::string lock_name = result_file + ".lock";
+    const int lock_fd = open(lock_name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        std::stringstream pids;
+        pids << std::ifstream(lock_name).rdbuf();
+        std::cerr << "Error: " << result_file << " is being scored by another run, or by the shard processes of a "
+                  << "stopped run (pids: " << pids.str() << "), wait for them or stop them first\n";
+        if (lock_fd >= 0)
+            close(lock_fd);
+        return false;
+    }
+    auto releaseLock = [&]()
+    {
+        std::remove(lock_name.c_str());
+        close(lock_fd);
+    };
+    if (!splitMoves(input_file, result_file, shards))
+    {
+        releaseLock();
+        return false;
+    }
 
-        double time_elapsed = duration.count() / 1000;
-        if (time_elapsed >= next_time)
+    auto start = std::chrono::high_resolution_clock::now();
+    auto shardName = [&](int k)
+    { return result_file + ".shard" + std::to_string(k); };
+    auto countLines = [](const std::string &name)
+    {
+        std::ifstream ifs(name, std::ios::binary);
+        std::vector<char> buffer(1 << 20);
+        long long lines = 0;
+        while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount() > 0)
+            lines += std::count(buffer.begin(), buffer.begin() + ifs.gcount(), '\n');
+        return lines;
+    };
+    auto launch = [&](int k)
+    {
+        const std::string moves = shardName(k) + ".moves", results = shardName(k), threads_arg = std::to_string(threads);
+        const pid_t pid = fork();
+        if (pid == 0)
+        {
+            execlp(program, program, moves.c_str(), results.c_str(), threads_arg.c_str(), (char *)nullptr);
+            std::cerr << "Error: Can't run " << program << "\n";
+            _exit(127);
+        }
+        return pid;
+    };
+
+    std::vector<long long> lines(shards);
+    std::map<pid_t, int> running; // pid -> shard
+    std::vector<int> failures(shards, 0);
+    auto savePids = [&]()
+    {
+        std::string pids = std::to_string(getpid());
+        for (const auto &process : running)
+            pids += " " + std::to_string(process.first);
+        if (ftruncate(lock_fd, 0) != 0 || pwrite(lock_fd, pids.data(), pids.size(), 0) < 0)
+            std::cerr << "Error: Can't write file " << lock_name << "\n";
+    };
+    for (int k = 0; k < shards; k++)
+    {
+        lines[k] = countLines(shardName(k) + ".moves");
+        if (countLines(shardName(k)) < lines[k])
+            running[launch(k)] = k;
+    }
+    savePids();
+
+    const int CHECK_PERIOD = 10;
+    int next_time = CHECK_PERIOD;
+    bool failed = false;
+    while (!running.empty())
+    {
+        int status;
+        const pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid > 0 && running.count(pid))
         {
-            std::cout << "Time elapsed: " << duration.count() / 1000 << " seconds, " << count << " lines processed\n";
+            const int k = running[pid];
+            running.erase(pid);
+            const long long done = countLines(shardName(k));
+            if (done >= lines[k])
+                std::cout << "Shard " << k << " done (" << done << " lines)\n";
+            else if (++failures[k] <= MAX_RESTARTS)
+            {
+                std::cerr << "Shard " << k << " stopped at line " << done << "/" << lines[k] << ", restarting it\n";
+                running[launch(k)] = k;
+            }
+            else
+            {
+                std::cerr << "Shard " << k << " failed " << MAX_RESTARTS + 1 << " times in a row, giving up\n";
+                failed = true;
+            }
+            savePids();
+            continue;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+        if (duration.count() >= next_time)
+        {
+            long long done = 0, total = 0;
+            for (int k = 0; k < shards; k++)
+            {
+                done += countLines(shardName(k));
+                total += lines[k];
+            }
+            std::cout << "Time elapsed: " << duration.count() << " seconds, " << done << "/" << total
+                      << " lines processed, " << running.size() << " shards running\n";
             next_time += CHECK_PERIOD;
-            moves_with_scores.flush();
         }
     }
+    if (failed)
+    {
+        releaseLock();
+        return false;
+    }
+
+    // merge the shards in order, then remove them (copying an empty shard would set the error state of out)
+    std::ofstream out(result_file, std::ios::binary | std::ios::trunc);
+    for (int k = 0; k < shards; k++)
+        if (lines[k] > 0)
+            out << std::ifstream(shardName(k), std::ios::binary).rdbuf();
+    out.close();
+    if (!out)
+    {
+        std::cerr << "Error: Can't write file " << result_file << "\n";
+        releaseLock();
+        return false;
+    }
+    std::remove((result_file + ".shards").c_str()); // first, a split with missing shards must not be merged again
+    for (int k = 0; k < shards; k++)
+    {
+        std::remove(shardName(k).c_str());
+        std::remove((shardName(k) + ".ckpt").c_str());
+        std::remove((shardName(k) + ".moves").c_str());
+    }
+    releaseLock();
+    std::cout << "Results of the " << shards << " shards written to " << result_file << "\n";
+    return true;
+#endif
 }
 
-void generateOpeningBook(const std::string& book_name) {
-    TranspositionTable* table = new TranspositionTable(268435459);
+/**
+ * Sort the book records of a file (in any order, a key given several times keeps its last record) to another file,
+ * with an external sort of memory_bytes.
+ */
+bool sortRecordFile(const std::string &input_file, const std::string &output_file, const size_t memory_bytes)
+{
+    ExternalSorter<> sorter(output_file, memory_bytes);
+    std::ifstream in(input_file, std::ios::binary);
+    std::vector<uint64_t> chunk(1 << 16);
+    while (in.read(reinterpret_cast<char *>(chunk.data()), chunk.size() * sizeof(uint64_t)) || in.gcount() > 0)
+        for (size_t i = 0; i < size_t(in.gcount()) / sizeof(uint64_t); i++)
+            sorter.Add(chunk[i]);
+
+    std::FILE *out = std::fopen((output_file + ".tmp").c_str(), "wb");
+    if (!out)
+    {
+        std::cerr << "Error: Can't open file " << output_file << ".tmp\n";
+        return false;
+    }
+    const bool ok = sorter.Finish([&](const uint64_t record)
+                                  { std::fwrite(&record, sizeof(record), 1, out); });
+    return replaceFile(out, output_file) && ok;
+}
+
+// Scores of a file of book records sorted by sortRecordFile(), searched where the file is mapped
+class SortedScores
+{
+public:
+    bool Open(const std::string &filename)
+    {
+        count = 0;
+        if (!file.Open(filename))
+            return false;
+        count = file.Size() / sizeof(uint64_t);
+        return true;
+    }
+
+    void Close()
+    {
+        file.Close();
+        count = 0;
+    }
+
+    // score of a position, MAX_SCORE + 1 if it is not in the file
+    int Get(const uint64_t key) const
+    {
+        const uint64_t *records = reinterpret_cast<const uint64_t *>(file.Data());
+        const uint64_t *it = std::lower_bound(records, records + count, key, [](uint64_t record, uint64_t k)
+                                              { return (record & KEY_MASK) < k; });
+        return it != records + count && (*it & KEY_MASK) == key ? int(*it >> 56) + Position::MIN_SCORE - 1
+                                                                : Position::MAX_SCORE + 1;
+    }
+
+private:
+    static const uint64_t KEY_MASK = (UINT64_C(1) << 56) - 1;
+    MappedFile file;
+    size_t count = 0;
+};
+
+/**
+ * Score a moves file layer by layer from the deepest positions up (retrograde): the deepest layer is solved by
+ * search, then the score of a shallower position is the negamax of the scores of its children, which are all in
+ * the layer below since explore() writes every child except the winning moves. A position is only searched when
+ * one of its children is missing (e.g. an incomplete moves file), so extending a book by one ply near the root
+ * costs lookups instead of solves.
+ * Positions already in result_file are not scored again, and the new scores are appended to it (grouped by layer,
+ * not in the order of the moves file), so an interrupted run continues from where it left.
+ * The memory does not grow with the files: the moves and the known scores are first split by layer into temporary
+ * files next to result_file, and a layer only needs the scores of the layer below, sorted on disk with an external
+ * sort of memory_mb and searched where the file is mapped.
+ * @param: threads, number of threads of the searches
+ * @param: memory_mb, memory budget of the sorts in MB
+ * @return false if the moves file holds no position or a file could not be written
+ */
+bool calculateScoreRetrograde(const std::string &input_file, const std::string &result_file, const unsigned int threads = 1,
+                              const size_t memory_mb = 1024)
+{
+    const int LAYERS = Position::WIDTH * Position::HEIGHT + 1;
+    const size_t BATCH_SIZE = 4096;
+    auto layerFile = [&](int depth, const std::string &kind)
+    { return result_file + ".layer" + std::to_string(depth) + "." + kind; };
 
+    std::ifstream moves_file(input_file);
+    if (!moves_file)
+    {
+        std::cerr << "Invalid moves file!";
+        return false;
+    }
+
+    // scores known so far, as book records appended to <result_file>.layer<depth>.done
+    std::vector<std::FILE *> done(LAYERS, nullptr);
+    bool ok = true;
+    auto addDone = [&](const int depth, const uint64_t record)
+    {
+        if (!done[depth] && !(done[depth] = std::fopen(layerFile(depth, "done").c_str(), "wb")))
+            ok = false;
+        else
+            ok = std::fwrite(&record, sizeof(record), 1, done[depth]) == 1 && ok;
+    };
+    std::ifstream results(result_file, std::ios::binary);
+    uint64_t results_size = 0; // of the complete lines
+    for (std::string line; getline(results, line) && !results.eof(); results_size += line.size() + 1)
+    {
+        const size_t space = line.find(' ');
+        char *end;
+        const long score = space == std::string::npos ? 0 : std::strtol(line.c_str() + space + 1, &end, 10);
+        Position P;
+        if (space != std::string::npos && end != line.c_str() + space + 1 && P.Play(line.substr(0, space)) == space &&
+            score >= Position::MIN_SCORE && score <= Position::MAX_SCORE)
+            addDone(P.nbMoves(), OpeningBook::Record(P.Key3(), uint8_t(score - Position::MIN_SCORE + 1)));
+    }
+    results.close();
+    std::error_code error;
+    if (std::filesystem::exists(result_file, error) && std::filesystem::file_size(result_file, error) > results_size)
+        std::filesystem::resize_file(result_file, results_size, error); // drop a line torn by a crash
+
+    // the moves, one file per layer (every line is a position, the empty one written first by explore() being the root)
+    std::vector<std::FILE *> layers(LAYERS, nullptr);
+    long long positions = 0;
+    for (std::string line; getline(moves_file, line);)
+    {
+        Position P;
+        if (P.Play(line) != line.size())
+            continue;
+        positions++;
+        std::FILE *&layer = layers[P.nbMoves()];
+        if (!layer && !(layer = std::fopen(layerFile(P.nbMoves(), "moves").c_str(), "wb")))
+        {
+            ok = false;
+            break;
+        }
+        line += '\n';
+        ok = std::fwrite(line.data(), 1, line.size(), layer) == line.size() && ok;
+    }
+    for (std::FILE *layer : layers)
+        if (layer)
+            ok = std::fclose(layer) == 0 && ok;
+    // the temporary files of the layers, all of them are removed when the function returns
+    auto removeLayers = [&]()
+    {
+        for (int depth = 0; depth < LAYERS; depth++)
+        {
+            if (done[depth])
+                std::fclose(done[depth]);
+            done[depth] = nullptr;
+            for (const char *kind : {"moves", "done", "known", "scores"})
+                std::remove(layerFile(depth, kind).c_str());
+        }
+    };
+    if (!ok || positions == 0)
+    {
+        if (ok)
+            std::cerr << "Error: No position in " << input_file << "\n";
+        else
+            std::cerr << "Error: Can't write the layers of " << input_file << " next to " << result_file << "\n";
+        removeLayers();
+        return false;
+    }
+
+    std::FILE *moves_with_scores = std::fopen(result_file.c_str(), "ab");
+    if (!moves_with_scores)
+    {
+        std::cerr << "Invalid results file!";
+        removeLayers();
+        return false;
+    }
+    Solver solver;
+    loadBook(solver);
+    SortedScores below; // scores of the layer below the one being scored
+    for (int depth = LAYERS - 1; depth >= 0; depth--)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        size_t derived = 0, searched = 0, skipped = 0;
+
+        // the scores of this layer already known, then the new ones, end up in the same done file
+        SortedScores known;
+        const bool had_done = done[depth] != nullptr;
+        if (had_done)
+        {
+            ok = std::fclose(done[depth]) == 0 && ok;
+            done[depth] = nullptr;
+            if (ok && layers[depth])
+                ok = sortRecordFile(layerFile(depth, "done"), layerFile(depth, "known"), memory_mb << 20) &&
+                     known.Open(layerFile(depth, "known"));
+        }
+        if (ok && (had_done || layers[depth]))
+            ok = (done[depth] = std::fopen(layerFile(depth, "done").c_str(), "ab")) != nullptr;
+
+        std::vector<std::string> search_lines;
+        std::vector<Position> search;
+        auto write = [&](const std::string &line, const Position &P, const int score)
+        {
+            std::fprintf(moves_with_scores, "%s %d\n", line.c_str(), score);
+            addDone(depth, OpeningBook::Record(P.Key3(), uint8_t(score - Position::MIN_SCORE + 1)));
+        };
+        auto solveSearched = [&]()
+        {
+            std::vector<int> scores = solver.SolveBatch(search, threads);
+            for (size_t i = 0; i < search.size(); ++i)
+                write(search_lines[i], search[i], scores[i]);
+            std::fflush(moves_with_scores);
+            searched += search.size();
+            search.clear();
+            search_lines.clear();
+        };
+
+        std::ifstream lines(layerFile(depth, "moves"));
+        for (std::string line; ok && layers[depth] && getline(lines, line);)
+        {
+            Position P;
+            P.Play(line);
+            if (known.Get(P.Key3()) <= Position::MAX_SCORE)
+            {
+                skipped++;
+                continue;
+            }
+
+            int score = -Position::WIDTH * Position::HEIGHT; // below any score
+            if (P.CanWinNext())
+                score = (Position::WIDTH * Position::HEIGHT + 1 - P.nbMoves()) / 2;
+            else if (P.nbMoves() == P.nbCells())
+                score = 0;
+            else
+                for (int col = 0; col < Position::WIDTH && score <= Position::MAX_SCORE; col++)
+                    if (P.CanPlay(col))
+                    {
+                        Position child(P);
+                        child.PlayCol(col);
+                        const int child_score = below.Get(child.Key3());
+                        score = child_score > Position::MAX_SCORE ? Position::MAX_SCORE + 1 : std::max(score, -child_score);
+                    }
+
+            if (score > Position::MAX_SCORE) // a child is missing
+            {
+                search_lines.push_back(line);
+                search.push_back(P);
+                if (search.size() == BATCH_SIZE)
+                    solveSearched();
+                continue;
+            }
+            write(line, P, score);
+            derived++;
+        }
+        if (!search.empty())
+            solveSearched();
+        std::fflush(moves_with_scores);
+        lines.close();
+
+        // the layer above needs the scores of this one, the ones below are not needed anymore
+        below.Close();
+        std::remove(layerFile(depth + 1, "scores").c_str());
+        if (done[depth])
+        {
+            ok = ok && std::fclose(done[depth]) == 0 &&
+                 sortRecordFile(layerFile(depth, "done"), layerFile(depth, "scores"), memory_mb << 20) &&
+                 below.Open(layerFile(depth, "scores"));
+            done[depth] = nullptr;
+        }
+        known.Close();
+        for (const char *kind : {"moves", "done", "known"})
+            std::remove(layerFile(depth, kind).c_str());
+        if (!ok)
+        {
+            std::cerr << "Error: Can't write the scores of layer " << depth << " next to " << result_file << "\n";
+            break;
+        }
+
+        if (layers[depth])
+        {
+            std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+            std::cout << "Layer " << depth << ": " << derived << " positions derived from their children, "
+                      << searched << " searched, " << skipped << " already scored, " << duration.count() << " seconds\n";
+        }
+    }
+    below.Close();
+    removeLayers();
+    return std::fclose(moves_with_scores) == 0 && ok;
+}
+
+/**
+ * Build the opening book from a results file (one position per line: <moves> <score>), keeping the last score
+ * of a position given several times.
+ * The positions are sorted with an external sort, so the memory used stays about memory_mb whatever the size
+ * of the file, and the sorted positions are written to the book as they come out of the merge.
+ * @param: memory_mb, memory budget of the sort in MB (the sorted runs are written next to the book when it is exceeded)
+ */
+void generateOpeningBook(const std::string& book_name, const size_t memory_mb = 1024) {
     std::ifstream in(book_name);
     if (!in) {
         std::cerr << "Cannot open file: " << book_name << std::endl;
         return;
     }
 
+    ExternalSorter<> sorter(OPENING_BOOK_PATH, memory_mb << 20);
     long long count = 1;
+    int depth = 0;
     for (std::string line; std::getline(in, line); count++) {
         if (line.empty()) break;
 
@@ -138,17 +909,45 @@ void generateOpeningBook(const std::string& book_name) {
             continue;
         }
 
-        table->Put(P.Key3(), score - Position::MIN_SCORE + 1);
+        sorter.Add(OpeningBook::Record(P.Key3(), score - Position::MIN_SCORE + 1));
+        depth = std::max(depth, P.nbMoves());
 
         if (count % 1000000 == 0)
             std::cerr << "Processed " << count << " lines\n";
     }
+    if (sorter.GetRuns() > 0)
+        std::cerr << sorter.GetRuns() << " sorted runs written, merging them\n";
 
-    OpeningBook book = OpeningBook(table);
+    OpeningBook::Writer writer(OPENING_BOOK_PATH, depth);
+    bool ok = bool(writer);
+    ok = sorter.Finish([&](uint64_t record)
+                       { ok = ok && writer.Add(record); }) && ok;
+    ok = ok && writer.Finish();
+    if (!ok) {
+        std::cerr << "Error: the book " << OPENING_BOOK_PATH << " could not be written\n";
+        return;
+    }
+    std::cout << "Saved " << writer.GetCount() << " positions to " << OPENING_BOOK_PATH << "\n";
+}
 
-    std::ostringstream book_file;
-    book_file << "data/depth_12_scores_7x6.book";
-    book.save(book_file.str());
+// Rewrite a book in another format (by default the compressed one, 1 for the uncompressed tree, 3 for the hashed one)
+void convertBook(const std::string &input_file, const std::string &output_file,
+                 const uint16_t version = OpeningBook::VERSION_COMPRESSED)
+{
+    OpeningBook book;
+    if (!book.load(input_file))
+        return;
+
+    std::vector<uint64_t> records;
+    records.reserve(book.GetSize());
+    if (!book.ForEach([&](uint64_t record)
+                      { records.push_back(record); }))
+    {
+        std::cerr << "Error: " << input_file << " does not keep its keys, it cannot be converted\n";
+        return;
+    }
+
+    OpeningBook::save(output_file, std::move(records), book.GetDepth(), version);
 }
 
 int main(int argc, char **argv)
@@ -157,30 +956,45 @@ int main(int argc, char **argv)
     {
         std::cerr << "Please enter arguments\n"
                   << "1. Explore and print moves to a file: enter <depth>\n"
-                  << "2. Calculate score for the moves: enter <input_file> <result_file>"
-                  << "3. Generate opening book: enter book <input_file>\n";
+                  << "2. Calculate score for the moves: enter <input_file> <result_file> [threads]\n"
+                  << "3. Generate opening book: enter book <input_file> [memory_MB]\n"
+                  << "4. Convert a book to the current format: enter convert <input_book> <output_book> [format]\n"
+                  << "5. Convert the warmup text file to the binary file loaded at startup: enter warmup [<text_file> <binary_file>]\n"
+                  << "6. Calculate score with several processes: enter shard <input_file> <result_file> <processes> [threads]\n"
+                  << "7. Calculate score from the deepest positions up: enter retro <input_file> <result_file> [threads] [memory_MB]\n";
         return 1;
     }
+    else if (argc == 2 && std::string(argv[1]) == "warmup")
+    {
+        KnowledgeStore::ConvertWarmup(WARMUP_BOOK_PATH, WARMUP_BINARY_PATH);
+    }
     else if (argc == 2)
     {
         // Explore
-        if (atoi(argv[1]) >= 0 && atoi(argv[1]) <= 42)
-        {
-            std::ofstream moves_explored_stream("data/moves_explored.txt");
-            std::unordered_set<uint64_t> visited;
-            int number_of_explored_moves = 0;
-
-            int depth = atoi(argv[1]);
-            char pos_str[depth + 1] = {0};
-            explore(Position(), pos_str, visited, number_of_explored_moves, depth, moves_explored_stream);
-            std::cout << "Number of moves: " << number_of_explored_moves;
-            return 0;
-        }
-        else {
-            std::cerr << "Invalid depth!";
+        long long number_of_explored_moves = explorePositions(atoi(argv[1]), "data/moves_explored.txt");
+        if (number_of_explored_moves < 0)
             return 1;
-        }
-
+        std::cout << "Number of moves: " << number_of_explored_moves;
+        return 0;
+    }
+    else if ((argc == 5 || argc == 6) && std::string(argv[1]) == "shard")
+    {
+        if (!calculateScoreSharded(argv[0], argv[2], argv[3], std::max(1, atoi(argv[4])), argc == 6 ? std::max(1, atoi(argv[5])) : 1))
+            return 1;
+    }
+    else if ((argc >= 4 && argc <= 6) && std::string(argv[1]) == "retro")
+    {
+        if (!calculateScoreRetrograde(argv[2], argv[3], argc >= 5 ? std::max(1, atoi(argv[4])) : 1,
+                                      argc == 6 ? std::max(1, atoi(argv[5])) : 1024))
+            return 1;
+    }
+    else if (argc == 4 && std::string(argv[1]) == "book")
+    {
+        generateOpeningBook(argv[2], std::max(1, atoi(argv[3])));
+    }
+    else if (argc == 4 && std::string(argv[1]) == "warmup")
+    {
+        KnowledgeStore::ConvertWarmup(argv[2], argv[3]);
     }
     else if (argc == 3)
     {
@@ -194,6 +1008,17 @@ int main(int argc, char **argv)
             calculateScore(argv[1], argv[2]);
         }
     }
+    else if (argc >= 4 && std::string(argv[1]) == "convert")
+    {
+        if (argc == 5)
+            convertBook(argv[2], argv[3], atoi(argv[4]));
+        else
+            convertBook(argv[2], argv[3]);
+    }
+    else if (argc == 4)
+    {
+        calculateScore(argv[1], argv[2], std::max(1, atoi(argv[3])));
+    }
     
 
     return 0;
@@ -1,16 +1,22 @@
 #include "header/RequestHandler.hpp"
 #include "header/Solver.hpp"
 #include "header/Game.hpp"
+#include "lib/json.hpp"
 #include "lib/argparse.hpp"
 
+#include <cmath>
 #include <unordered_set>
 #include <utility>
+#include <random>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 
-int runTest()
+int runTest(const SolveDriver driver)
 {
 	Solver solver;
+	solver.SetDriver(driver);
 	ifstream testStream("tests/10_moves.test");
 
 	if (!testStream)
@@ -36,11 +42,10 @@ int runTest()
 		{
 			auto start = chrono::high_resolution_clock::now();
 			const int best_move = solver.FindBestMove(P);
+			const int score = solver.GetLastStats().score;
 			auto end = chrono::high_resolution_clock::now();
 			chrono::duration<double, milli> duration = end - start;
 
-			const int score = solver.Solve(P);
-
 			cout << line
 				 << ": " << P.nbMoves() << " moves, "
 				 << "Score: " << score
@@ -56,12 +61,178 @@ int runTest()
 		l++;
 	}
 
+	cout << "Knowledge: ";
+	solver.knowledge.PrintStats(cout);
 	return 0;
 }
 
-void findMoveAndCalculateScore()
+// Latency (ms) below which a share p of the sorted times are, nearest rank
+double percentile(const vector<double> &sorted_times, const double p)
+{
+	if (sorted_times.empty())
+		return 0;
+	const size_t rank = size_t(ceil(p * sorted_times.size()));
+	return sorted_times[min(sorted_times.size(), max<size_t>(rank, 1)) - 1];
+}
+
+// Totals and latency distribution of a set of solved positions
+nlohmann::json benchSummary(const vector<double> &times, const unsigned long long nodes, const size_t correct,
+							const size_t incorrect, const size_t invalid)
 {
+	vector<double> sorted_times(times);
+	sort(sorted_times.begin(), sorted_times.end());
+	double total_ms = 0;
+	for (double t : times)
+		total_ms += t;
+	return {
+		{"positions", times.size()},
+		{"correct", correct},
+		{"incorrect", incorrect},
+		{"invalid", invalid},
+		{"nodes", nodes},
+		{"time_ms", total_ms},
+		{"nodes_per_sec", total_ms > 0 ? nodes / (total_ms / 1000) : 0},
+		{"latency_ms",
+		 {{"mean", times.empty() ? 0 : total_ms / times.size()},
+		  {"p50", percentile(sorted_times, 0.50)},
+		  {"p90", percentile(sorted_times, 0.90)},
+		  {"p99", percentile(sorted_times, 0.99)},
+		  {"max", sorted_times.empty() ? 0 : sorted_times.back()}}}};
+}
+
+/**
+ * Solve the positions of test files (lines "<sequence> <score>") one at a time, check the scores and report the nodes
+ * and time of each position and the totals and latency percentiles of each file and of all of them, as JSON.
+ * @param: driver, strategy Solve() narrows down the scores with
+ * @param: cold, if true the table and the learned scores are cleared before each position, so that every search starts
+ * from scratch; otherwise the table is kept warm from one position to the next, like in a game
+ * @param: book, if true the opening book and the warmup positions are loaded first, as in the other modes
+ * @param: weak, if true the positions are only solved as a win, a draw or a loss (Solve(P, true)), and checked
+ * against the sign of the expected scores, to compare the latency of a weak solve with the one of a strong solve
+ * @param: limit, maximum number of positions solved per file, 0 for all of them
+ * @param: output_file, file the JSON is written to, the standard output if empty (progress goes to the error output)
+ *
+ * @return 0 if every score is correct, 1 otherwise
+ */
+int runBenchmark(const vector<string> &files, const SolveDriver driver, const bool cold, const bool book,
+				 const bool weak, const size_t limit, const string &output_file)
+{
+	// keep the standard output for the JSON only
+	streambuf *stdout_buffer = cout.rdbuf(cerr.rdbuf());
+
 	Solver solver;
+	solver.SetDriver(driver);
+	if (book)
+		solver.GetReady();
+	solver.knowledge.ResetStats();
+
+	nlohmann::json report;
+	report["config"] = {{"driver", driver == SolveDriver::Mtdf ? "mtdf" : "bisection"},
+						{"cold", cold},
+						{"book", book},
+						{"weak", weak},
+						{"limit", limit},
+						{"table_entries", solver.transTable.GetSize()}};
+	report["files"] = nlohmann::json::array();
+
+	vector<double> all_times;
+	unsigned long long all_nodes = 0;
+	size_t all_correct = 0, all_incorrect = 0, all_invalid = 0;
+	for (const string &file : files)
+	{
+		ifstream test_stream(file);
+		if (!test_stream)
+		{
+			cerr << "Cannot open test file " << file << "\n";
+			cout.rdbuf(stdout_buffer);
+			return 1;
+		}
+
+		nlohmann::json results = nlohmann::json::array();
+		vector<double> times;
+		unsigned long long nodes = 0;
+		size_t correct = 0, incorrect = 0, invalid = 0;
+		string line;
+		int expected;
+		while ((limit == 0 || times.size() + invalid < limit) && test_stream >> line >> expected)
+		{
+			if (weak)
+				expected = (expected > 0) - (expected < 0);
+			Position P;
+			if (P.Play(line) != line.size())
+			{
+				cerr << file << ": invalid move " << (P.nbMoves() + 1) << " \"" << line << "\"\n";
+				invalid++;
+				continue;
+			}
+			if (cold)
+			{
+				solver.Reset();
+				solver.knowledge.ForgetLearned();
+			}
+
+			auto start = chrono::steady_clock::now();
+			const int score = solver.Solve(P, weak);
+			chrono::duration<double, milli> duration = chrono::steady_clock::now() - start;
+			const unsigned long long position_nodes = solver.GetLastStats().nodes;
+
+			times.push_back(duration.count());
+			nodes += position_nodes;
+			score == expected ? correct++ : incorrect++;
+			results.push_back({{"sequence", line},
+							   {"moves", P.nbMoves()},
+							   {"score", score},
+							   {"expected", expected},
+							   {"nodes", position_nodes},
+							   {"time_ms", duration.count()}});
+			if (score != expected)
+				cerr << file << ": " << line << " INCORRECT, score " << score << " instead of " << expected << "\n";
+			if (times.size() % 100 == 0)
+				cerr << file << ": " << times.size() << " positions solved\n";
+		}
+
+		nlohmann::json summary = benchSummary(times, nodes, correct, incorrect, invalid);
+		cerr << file << ": " << times.size() << " positions, " << incorrect << " incorrect, "
+			 << summary["time_ms"].get<double>() << " ms, " << summary["nodes_per_sec"].get<double>() << " nodes/s\n";
+		summary["file"] = file;
+		summary["results"] = std::move(results);
+		report["files"].push_back(std::move(summary));
+
+		all_times.insert(all_times.end(), times.begin(), times.end());
+		all_nodes += nodes;
+		all_correct += correct;
+		all_incorrect += incorrect;
+		all_invalid += invalid;
+	}
+	report["overall"] = benchSummary(all_times, all_nodes, all_correct, all_incorrect, all_invalid);
+
+	static const char *source_names[KnowledgeStore::SOURCES] = {"book", "warmup", "learned"};
+	for (int s = 0; s < KnowledgeStore::SOURCES; s++)
+	{
+		const KnowledgeStore::SourceStats stats = solver.knowledge.GetStats(KnowledgeStore::Source(s));
+		report["knowledge"][source_names[s]] = {{"size", stats.size}, {"lookups", stats.lookups}, {"hits", stats.hits}};
+	}
+
+	cout.rdbuf(stdout_buffer);
+	if (output_file.empty())
+		cout << report.dump(2) << "\n";
+	else
+	{
+		ofstream output_stream(output_file);
+		output_stream << report.dump(2) << "\n";
+		if (!output_stream)
+		{
+			cerr << "Error: Can't write file " << output_file << "\n";
+			return 1;
+		}
+	}
+	return all_incorrect == 0 && all_invalid == 0 ? 0 : 1;
+}
+
+void findMoveAndCalculateScore(const SolveDriver driver)
+{
+	Solver solver;
+	solver.SetDriver(driver);
 	solver.GetReady();
 
 	string line;
@@ -76,14 +247,16 @@ void findMoveAndCalculateScore()
 		else
 		{
 			auto start = chrono::high_resolution_clock::now();
-			const int score = solver.Solve(P);
 			const int best_move = solver.FindBestMove(P);
+			const int score = solver.GetLastStats().score;
+			const int probes = solver.GetLastStats().probes;
 			auto end = chrono::high_resolution_clock::now();
 			chrono::duration<double, milli> duration = end - start;
 
 			cout << line
 				 << ": " << P.nbMoves() << " moves, "
 				 << "Score: " << score
+				 << ", Probes: " << probes
 				 << ", Nodes: " << solver.GetNodeCount()
 				 << ", Time: " << duration.count() << " ms"
 				 << ", Best move: column " << best_move + 1 << "\n";
@@ -91,14 +264,16 @@ void findMoveAndCalculateScore()
 	}
 }
 
-void continuouslyFindMoveAndCalculateScore()
+void continuouslyFindMoveAndCalculateScore(const SolveDriver driver)
 {
 	Solver solver;
+	solver.SetDriver(driver);
 	solver.GetReady();
 
 	string current_sequence;
 	Position P;
 	string line;
+	int last_score = Solver::NO_HINT;
 	while (getline(cin, line))
 	{
 		if (P.Play(line) != line.size())
@@ -110,14 +285,21 @@ void continuouslyFindMoveAndCalculateScore()
 			current_sequence += line;
 			auto start = chrono::high_resolution_clock::now();
 
-			const int score = solver.Solve(P);
-			const unsigned int best_move = solver.FindBestMove(P);
+			// the score of the previous board is a good guess, negated if the other player is now to move
+			int hint = last_score;
+			if (hint != Solver::NO_HINT && line.size() % 2 == 1)
+				hint = -hint;
+			const unsigned int best_move = solver.FindBestMove(P, false, hint);
+			const int score = solver.GetLastStats().score;
+			const int probes = solver.GetLastStats().probes;
+			last_score = score;
 
 			auto end = chrono::high_resolution_clock::now();
 			chrono::duration<double, milli> duration = end - start;
 			cout << current_sequence
 				 << ": " << P.nbMoves() << " moves, "
 				 << "Score: " << score
+				 << ", Probes: " << probes
 				 << ", Nodes: " << solver.GetNodeCount()
 				 << ", Time: " << duration.count() << " ms"
 				 << ", Best move: column " << best_move + 1 << "\n";
@@ -125,72 +307,152 @@ void continuouslyFindMoveAndCalculateScore()
 	}
 }
 
-void startTraining()
+/**
+ * Pick the opening of a training game:
+ * - "random": 0 to 8 random moves, none of them winning or letting the opponent win right away
+ * - "book": 0 to 12 moves, each one drawn among the moves whose score (from the book) is at most one point below the
+ *   best one, i.e. the openings a strong opponent could play; random moves where the scores are unknown
+ * - otherwise a file of sequences (e.g. collected from the requests of the platform), one drawn at random
+ */
+string sampleOpening(const string &source, const vector<string> &sequences, const Solver &solver, mt19937 &rng)
 {
-	ofstream hard_moves_stream("hard_moves.txt");
-	unordered_set<string> seen_lines;
-
-	Solver solver;
-	solver.GetReady();
+	if (!sequences.empty())
+		return sequences[uniform_int_distribution<size_t>(0, sequences.size() - 1)(rng)];
 
-	cout << "\n<------------------>\n"
-		 << "THE GAME HAS STARTED\n"
-		 << "<------------------>\n\n";
-
-	string initial_sequence = "44444";
-	string sequence = initial_sequence;
+	const bool book = source == "book";
+	const int length = uniform_int_distribution<int>(0, book ? 12 : 8)(rng);
 	Position P;
-	P.Play(sequence);
-
-	int move;
-	string player_name;
-	bool is_red_turn;
-	while (true)
+	string sequence;
+	while (P.nbMoves() < length && !P.CanWinNext())
 	{
-		if (P.nbMoves() == 15)
+		const int UNKNOWN = Position::MIN_SCORE - 1, UNPLAYABLE = Position::MIN_SCORE - 2;
+		int scores[Position::WIDTH];
+		int best = UNPLAYABLE;
+		for (int col = 0; col < Position::WIDTH; col++)
 		{
-			sequence = initial_sequence;
-			P = Position();
-			P.Play(sequence);
+			scores[col] = UNPLAYABLE;
+			if (!(P.PossibleNonLosingMoves() & Position::ColumnMask(col)))
+				continue;
+			Position child(P);
+			child.PlayCol(col);
+			const int val = book ? solver.knowledge.Get(child.Key3(), child.nbMoves()) : 0;
+			scores[col] = val ? -(val + Position::MIN_SCORE - 1) : UNKNOWN;
+			best = max(best, scores[col]);
 		}
+		vector<int> cols;
+		for (int col = 0; col < Position::WIDTH; col++)
+			if (scores[col] != UNPLAYABLE && scores[col] >= best - 1)
+				cols.push_back(col);
+		if (cols.empty())
+			break;
+		const int col = cols[uniform_int_distribution<size_t>(0, cols.size() - 1)(rng)];
+		P.PlayCol(col);
+		sequence += to_string(col + 1);
+	}
+	return sequence;
+}
 
-		is_red_turn = (sequence.size() + 1) % 2;
-		cout << "Position: " << sequence << ", " << sequence.size() << " moves\n";
-
-		if (is_red_turn)
-			player_name = "Red";
-		else
-			player_name = "Yellow";
+/**
+ * Play bot games from varied openings on several threads and append the positions whose move was hard to find
+ * (at least hard_ms milliseconds or hard_nodes nodes) to data/hard_moves.txt, for the warmup generator.
+ * A game stops after 15 moves, or when the next move wins. The threads share the table and the knowledge, and a
+ * position is written once, transpositions and positions already in the file or with a known score included.
+ */
+void startTraining(unsigned int threads, const string &openings, const double hard_ms, const unsigned long long hard_nodes,
+				   const SolveDriver driver)
+{
+	const string HARD_MOVES_PATH = "data/hard_moves.txt";
+	const int MAX_MOVES = 15;
 
-		cout << player_name << " is thinking...\n";
+	Solver solver;
+	solver.SetDriver(driver); // the solvers of the other games are forked from this one
+	solver.GetReady();
 
-		auto start = chrono::high_resolution_clock::now();
-		// Play randomly at the 7th move of the board
-		// if (P.nbMoves() == 7)
-		// 	move = solver.RandomMove();
-		// else
-		move = solver.FindBestMove(P);
-		auto end = chrono::high_resolution_clock::now();
-		chrono::duration<double, milli> duration = end - start;
+	mutex seen_mutex;
+	unordered_set<uint64_t> seen;
+	ifstream previous(HARD_MOVES_PATH);
+	for (string line; getline(previous, line);)
+	{
+		Position P;
+		if (P.Play(line) == line.size())
+			seen.insert(P.Key3());
+	}
+	previous.close();
+	ofstream hard_moves_stream(HARD_MOVES_PATH, ios::app);
 
-		if (duration.count() >= 2000 && seen_lines.find(sequence) == seen_lines.end())
+	vector<string> sequences;
+	if (openings != "random" && openings != "book")
+	{
+		ifstream ifs(openings);
+		for (string line; getline(ifs, line);)
+		{
+			Position P;
+			// the games play no move from an opening of MAX_MOVES moves or more, it would be sampled forever
+			if (!line.empty() && P.Play(line) == line.size() && !P.CanWinNext() && P.nbMoves() < MAX_MOVES)
+				sequences.push_back(line);
+		}
+		if (sequences.empty())
 		{
-			cout << "HARD MOVE FOUND: " << sequence << "\n";
-			seen_lines.insert(sequence);
-			hard_moves_stream << sequence << "\n";
-			hard_moves_stream.flush();
+			cerr << "No opening of less than " << MAX_MOVES << " moves (not won by the next move) found in " << openings << "\n";
+			return;
 		}
+	}
 
-		cout << player_name << " has played: column " << move + 1 << ", " << duration.count() << " ms.\n";
+	cout << "\n<------------------>\n"
+		 << "TRAINING HAS STARTED (" << threads << " threads, " << openings << " openings)\n"
+		 << "<------------------>\n\n";
+	cout.flush();
 
-		P.PlayCol(move);
-		sequence += to_string(move + 1);
+	auto play = [&](Solver &bot, const unsigned int seed)
+	{
+		mt19937 rng(seed);
+		while (true)
+		{
+			string sequence = sampleOpening(openings, sequences, bot, rng);
+			Position P;
+			P.Play(sequence);
+			while (P.nbMoves() < MAX_MOVES && !P.CanWinNext())
+			{
+				const bool known = bot.knowledge.Get(P.Key3(), P.nbMoves()); // before the search learns it
+				auto start = chrono::high_resolution_clock::now();
+				const int move = bot.FindBestMove(P);
+				chrono::duration<double, milli> duration = chrono::high_resolution_clock::now() - start;
+				const unsigned long long nodes = bot.GetLastStats().nodes;
+
+				if (duration.count() >= hard_ms || nodes >= hard_nodes)
+				{
+					lock_guard<mutex> lock(seen_mutex);
+					if (!known && seen.insert(P.Key3()).second)
+					{
+						cout << "HARD MOVE FOUND: " << sequence << " (" << P.nbMoves() << " moves, " << nodes << " nodes, "
+							 << duration.count() << " ms)\n";
+						cout.flush();
+						hard_moves_stream << sequence << "\n";
+						hard_moves_stream.flush();
+					}
+				}
+
+				P.PlayCol(move);
+				sequence += to_string(move + 1);
+			}
+		}
+	};
+
+	random_device rd;
+	vector<unique_ptr<Solver>> bots;
+	vector<thread> pool;
+	for (unsigned int t = 1; t < threads; t++)
+	{
+		bots.push_back(solver.Fork());
+		pool.emplace_back(play, ref(*bots.back()), rd());
 	}
+	play(solver, rd());
 }
 
-void handleAPIRequest(string ip, const int port)
+void handleAPIRequest(string ip, const int port, const unsigned long long journal_min_nodes,
+					  const HardPositionMiner::Options &miner_options, const SolveDriver driver)
 {
-	RequestHandler requestHandler(std::move(ip), port);
+	RequestHandler requestHandler(std::move(ip), port, journal_min_nodes, miner_options, driver);
 	requestHandler.Run();
 }
 
@@ -205,6 +467,58 @@ int main(const int argc, char **argv)
 	program.add_argument("-b", "--botgame").help("See a match between 2 bots").flag();
 	program.add_argument("-tr", "--train").help("Perform a training session to find hard moves").flag();
 	program.add_argument("-w", "--web").help("Handle API requests").flag();
+	program.add_argument("-bm", "--bench").help("Benchmark the solver on test files, the results are printed as JSON").flag();
+	program.add_argument("--driver")
+		.help("Strategy narrowing down the scores in every mode: mtdf or bisection")
+		.default_value(string("mtdf"))
+		.choices("mtdf", "bisection");
+	program.add_argument("--bench-files")
+		.help("With -bm, test files to solve")
+		.nargs(argparse::nargs_pattern::at_least_one)
+		.default_value(vector<string>{"tests/10_moves.test", "tests/begin_medium.test", "tests/begin_hard.test"});
+	program.add_argument("--bench-cold")
+		.help("With -bm, clear the table and the learned scores before each position")
+		.flag();
+	program.add_argument("--bench-book")
+		.help("With -bm, load the opening book and the warmup positions first")
+		.flag();
+	program.add_argument("--bench-weak")
+		.help("With -bm, only solve the positions as a win, a draw or a loss")
+		.flag();
+	program.add_argument("--bench-limit")
+		.help("With -bm, maximum number of positions solved per file (0 for all)")
+		.default_value(size_t(0))
+		.scan<'u', size_t>();
+	program.add_argument("--bench-out")
+		.help("With -bm, file the JSON is written to instead of the standard output")
+		.default_value(string());
+	program.add_argument("--train-threads")
+		.help("With -tr, number of games played at the same time")
+		.default_value(max(1U, thread::hardware_concurrency()))
+		.scan<'u', unsigned int>();
+	program.add_argument("--openings")
+		.help("With -tr, openings of the games: random, book, or a file of sequences")
+		.default_value(string("random"));
+	program.add_argument("--journal-min-nodes")
+		.help("With -w, keep the scores of the positions solved with at least this number of nodes in " + JOURNAL_PATH)
+		.default_value(1000000ULL)
+		.scan<'u', unsigned long long>();
+	program.add_argument("--miner-threads")
+		.help("With -w, number of background threads solving the hard positions between requests (0 to disable)")
+		.default_value(1U)
+		.scan<'u', unsigned int>();
+	program.add_argument("--miner-cpu")
+		.help("With -w, percentage of a core each miner thread may use")
+		.default_value(50.0)
+		.scan<'g', double>();
+	program.add_argument("--hard-ms")
+		.help("With -w or -tr, searches taking at least this time (ms) are hard and mined")
+		.default_value(2000.0)
+		.scan<'g', double>();
+	program.add_argument("--hard-nodes")
+		.help("With -w or -tr, searches taking at least this number of nodes are hard and mined")
+		.default_value(50000000ULL)
+		.scan<'u', unsigned long long>();
 
 	program.add_description("Connect four AI by Tralalero Tralala");
 
@@ -240,6 +554,8 @@ int main(const int argc, char **argv)
 		++flag_count;
 	if (program["-w"] == true)
 		++flag_count;
+	if (program["-bm"] == true)
+		++flag_count;
 
 	if (flag_count != 1)
 	{
@@ -248,26 +564,40 @@ int main(const int argc, char **argv)
 		std::exit(1);
 	}
 
+	const SolveDriver driver = program.get<string>("--driver") == "bisection" ? SolveDriver::Bisection : SolveDriver::Mtdf;
 	if (program["-t"] == true)
-		runTest();
+		runTest(driver);
 	else if (program["-f"] == true)
-		findMoveAndCalculateScore();
+		findMoveAndCalculateScore(driver);
 	else if (program["-c"] == true)
-		continuouslyFindMoveAndCalculateScore();
+		continuouslyFindMoveAndCalculateScore(driver);
 	else if (program["-p"] == true)
 	{
-		Game game;
+		Game game(driver);
 		game.StartPlayerVsBotGame();
 	}
 	else if (program["-b"] == true)
 	{
-		Game game;
+		Game game(driver);
 		game.StartBotGame();
 	}
 	else if (program["-tr"] == true)
-		startTraining();
+		startTraining(max(1U, program.get<unsigned int>("--train-threads")), program.get<string>("--openings"),
+					  program.get<double>("--hard-ms"), program.get<unsigned long long>("--hard-nodes"), driver);
+	else if (program["-bm"] == true)
+		return runBenchmark(program.get<vector<string>>("--bench-files"), driver, program.get<bool>("--bench-cold"),
+							program.get<bool>("--bench-book"), program.get<bool>("--bench-weak"),
+							program.get<size_t>("--bench-limit"),
+							program.get<string>("--bench-out"));
 	else if (program["-w"] == true)
-		handleAPIRequest("0.0.0.0", 8112);
+	{
+		HardPositionMiner::Options miner_options;
+		miner_options.threads = program.get<unsigned int>("--miner-threads");
+		miner_options.cpu_share = program.get<double>("--miner-cpu") / 100;
+		miner_options.min_ms = program.get<double>("--hard-ms");
+		miner_options.min_nodes = program.get<unsigned long long>("--hard-nodes");
+		handleAPIRequest("0.0.0.0", 8112, program.get<unsigned long long>("--journal-min-nodes"), miner_options, driver);
+	}
 
 	return 0;
 }
\ No newline at end of file
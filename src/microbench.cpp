@@ -0,0 +1,277 @@
+#include "header/Position.hpp"
+#include "header/MoveSorter.hpp"
+#include "header/TranspositionTable.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Microbenchmarks of the primitives the search spends its time in, to judge a change of the hot path without
+ * running full solves: make microbench ARGS="[repetitions] [table_entries]"
+ *
+ * Each benchmark runs over a fixed set of positions (or keys) drawn with a fixed seed, so that two runs of two
+ * builds time the same work. It is first run for a while to warm up the caches and the CPU clock, and to choose the
+ * number of passes of a repetition (about 20 ms each). The time per operation is then measured on each repetition,
+ * and the median is reported with the minimum and the median absolute deviation of the repetitions: a deviation of
+ * more than a few percent means the machine was busy and the run should be done again.
+ */
+
+using namespace std;
+
+static const int POSITIONS = 4096;
+static const double REPETITION_MS = 20;
+static const double WARMUP_MS = 200;
+
+// results are added to it so that the compiler cannot remove the work measured
+volatile uint64_t sink;
+
+struct Measure
+{
+    double median;
+    double min;
+    double deviation; // median absolute deviation of the repetitions, relative to the median
+};
+
+/**
+ * Time a benchmark.
+ * @param: pass, runs the benchmark once over its whole input and returns a value depending on all its results
+ * @param: ops, number of operations done by a pass
+ */
+template <class Pass>
+Measure measure(Pass pass, const size_t ops, const int repetitions)
+{
+    using clock = chrono::steady_clock;
+    uint64_t acc = 0;
+
+    // warmup, and number of passes per repetition
+    size_t passes = 0;
+    auto start = clock::now();
+    chrono::duration<double, milli> elapsed{0};
+    for (; elapsed.count() < WARMUP_MS; elapsed = clock::now() - start, passes++)
+        acc += pass();
+    const size_t passes_per_repetition = max<size_t>(1, size_t(passes * REPETITION_MS / elapsed.count()));
+
+    vector<double> ns_per_op;
+    for (int r = 0; r < repetitions; r++)
+    {
+        start = clock::now();
+        for (size_t i = 0; i < passes_per_repetition; i++)
+            acc += pass();
+        chrono::duration<double, nano> duration = clock::now() - start;
+        ns_per_op.push_back(duration.count() / (double(passes_per_repetition) * ops));
+    }
+    sink = sink + acc;
+
+    // median and median absolute deviation: a repetition slowed down by another process does not move them
+    sort(ns_per_op.begin(), ns_per_op.end());
+    const double median = ns_per_op[repetitions / 2];
+    vector<double> deviations;
+    for (double t : ns_per_op)
+        deviations.push_back(abs(t - median));
+    sort(deviations.begin(), deviations.end());
+    return {median, ns_per_op[0], median > 0 ? deviations[repetitions / 2] / median : 0};
+}
+
+void report(const string &name, const Measure &m)
+{
+    cout << left << setw(48) << name << right << fixed << setprecision(2) << setw(10) << m.median << setw(10) << m.min
+         << setw(9) << setprecision(1) << m.deviation * 100 << "%" << (m.deviation > 0.05 ? "  noisy" : "") << "\n";
+}
+
+// Positions of random games of 4 to 34 moves, none of them won or winnable by the next move
+vector<Position> randomPositions(mt19937_64 &rng)
+{
+    vector<Position> positions;
+    while (positions.size() < POSITIONS)
+    {
+        const int length = uniform_int_distribution<int>(4, 34)(rng);
+        Position P;
+        while (P.nbMoves() < length)
+        {
+            const uint64_t moves = P.PossibleNonLosingMoves();
+            if (!moves || P.CanWinNext())
+                break;
+            vector<int> cols;
+            for (int col = 0; col < Position::WIDTH; col++)
+                if (moves & Position::ColumnMask(col))
+                    cols.push_back(col);
+            P.PlayCol(cols[uniform_int_distribution<size_t>(0, cols.size() - 1)(rng)]);
+        }
+        if (P.nbMoves() == length && !P.CanWinNext() && P.PossibleNonLosingMoves())
+            positions.push_back(P);
+    }
+    return positions;
+}
+
+void benchPosition(const vector<Position> &positions, const int repetitions)
+{
+    // the non losing moves of each position, as the search plays them
+    vector<pair<Position, uint64_t>> moves;
+    for (const Position &P : positions)
+    {
+        const uint64_t possible = P.PossibleNonLosingMoves();
+        for (int col = 0; col < Position::WIDTH; col++)
+            if (possible & Position::ColumnMask(col))
+                moves.emplace_back(P, possible & Position::ColumnMask(col));
+    }
+
+    report("Position::PossibleNonLosingMoves", measure([&]
+                                                       {
+        uint64_t acc = 0;
+        for (const Position &P : positions)
+            acc += P.PossibleNonLosingMoves();
+        return acc; },
+                                                       positions.size(), repetitions));
+
+    report("Position::MoveScore", measure([&]
+                                          {
+        uint64_t acc = 0;
+        for (const auto &m : moves)
+            acc += m.first.MoveScore(m.second);
+        return acc; },
+                                          moves.size(), repetitions));
+
+    report("Position::Play (copy of the position included)", measure([&]
+                                                                     {
+        uint64_t acc = 0;
+        for (const auto &m : moves)
+        {
+            Position P(m.first);
+            P.Play(m.second);
+            acc += P.Key();
+        }
+        return acc; },
+                                                                     moves.size(), repetitions));
+
+    report("Position::Key3", measure([&]
+                                     {
+        uint64_t acc = 0;
+        for (const Position &P : positions)
+            acc += P.Key3();
+        return acc; },
+                                     positions.size(), repetitions));
+
+    report("Position::TableKey", measure([&]
+                                         {
+        uint64_t acc = 0;
+        for (const Position &P : positions)
+            acc += P.TableKey();
+        return acc; },
+                                         positions.size(), repetitions));
+}
+
+void benchMoveSorter(const vector<Position> &positions, const int repetitions)
+{
+    // the moves and scores each position adds to the sorter in the search
+    vector<vector<pair<uint64_t, int>>> scored(positions.size());
+    size_t count = 0;
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        const uint64_t possible = positions[i].PossibleNonLosingMoves();
+        for (int col = 0; col < Position::WIDTH; col++)
+            if (uint64_t move = possible & Position::ColumnMask(col))
+                scored[i].emplace_back(move, positions[i].MoveScore(move));
+        count += scored[i].size();
+    }
+
+    report("MoveSorter::Add + GetNext (per move)", measure([&]
+                                                           {
+        uint64_t acc = 0;
+        for (const auto &list : scored)
+        {
+            MoveSorter sorter;
+            for (const auto &m : list)
+                sorter.Add(m.first, m.second);
+            while (uint64_t next = sorter.GetNext())
+                acc += next;
+        }
+        return acc; },
+                                                           count, repetitions));
+}
+
+void benchTable(const size_t entries, const int repetitions, mt19937_64 &rng)
+{
+    static const size_t LOOKUPS = 1 << 16;
+    static const uint64_t KEY_MASK = (UINT64_C(1) << 56) - 1; // the bits of the key the table keeps
+
+    TranspositionTable table(entries);
+    vector<uint64_t> stored;
+    for (double load : {0.25, 0.5, 0.75, 0.9})
+    {
+        // fill the table up to the load, the keys are random like the keys of positions modulo the size
+        while (stored.size() < size_t(load * entries))
+        {
+            const uint64_t key = rng() & KEY_MASK;
+            if (key == 0 || table.Get(key))
+                continue;
+            table.Put(key, uint8_t(key % 255 + 1));
+            stored.push_back(key);
+        }
+
+        vector<uint64_t> hits(LOOKUPS), misses;
+        for (uint64_t &key : hits)
+            key = stored[uniform_int_distribution<size_t>(0, stored.size() - 1)(rng)];
+        while (misses.size() < LOOKUPS)
+        {
+            const uint64_t key = rng() & KEY_MASK;
+            if (key && !table.Get(key))
+                misses.push_back(key);
+        }
+
+        const string suffix = " (load " + to_string(int(load * 100)) + "%)";
+        report("TranspositionTable::Get hit" + suffix, measure([&]
+                                                               {
+            uint64_t acc = 0;
+            for (uint64_t key : hits)
+                acc += table.Get(key);
+            return acc; },
+                                                               hits.size(), repetitions));
+        report("TranspositionTable::Get miss" + suffix, measure([&]
+                                                                {
+            uint64_t acc = 0;
+            for (uint64_t key : misses)
+                acc += table.Get(key);
+            return acc; },
+                                                                misses.size(), repetitions));
+        // overwriting stored keys keeps the load the same from one pass to the next
+        report("TranspositionTable::Put" + suffix, measure([&]
+                                                           {
+            for (uint64_t key : hits)
+                table.Put(key, uint8_t(key % 255 + 1));
+            return uint64_t(0); },
+                                                           hits.size(), repetitions));
+        // the same entries at once, on one thread to compare with the loop of Put()
+        vector<pair<uint64_t, uint8_t>> batch;
+        for (uint64_t key : hits)
+            batch.emplace_back(key, uint8_t(key % 255 + 1));
+        report("TranspositionTable::PutBatch" + suffix, measure([&]
+                                                                { return uint64_t(table.PutBatch(batch)); },
+                                                                batch.size(), repetitions));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const int repetitions = argc > 1 ? max(3, atoi(argv[1])) : 15;
+    const size_t table_entries = argc > 2 ? max(1024L, atol(argv[2])) : 67108879; // the size of the solver's table
+
+    mt19937_64 rng(42);
+    const vector<Position> positions = randomPositions(rng);
+
+    cout << repetitions << " repetitions, table of " << table_entries << " entries\n";
+    cout << left << setw(48) << "benchmark" << right << setw(10) << "ns/op" << setw(10) << "min" << setw(10) << "mad"
+         << "\n";
+    benchPosition(positions, repetitions);
+    benchMoveSorter(positions, repetitions);
+    benchTable(table_entries, repetitions, rng);
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include "header/Position.hpp"
+#include "header/Solver.hpp"
+#include "header/TranspositionTable.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+ * Unit tests of the keys of the positions and of the tables and the knowledge they index: make test (with the generator tests)
+ *
+ * The positions are drawn with a fixed seed, so that a failure can be replayed. Each failed check is printed, and the
+ * exit code is 1 if one of them failed.
+ */
+
+using namespace std;
+
+static const int SAMPLES = 50000;
+static const uint64_t TABLE_KEY_LIMIT = UINT64_C(1) << 56; // the bits of a key the transposition table keeps
+static const uint64_t HIDDEN_TABLE_KEYS = UINT64_C(1) << Position::WIDTH * (Position::HEIGHT + 1); // first key of a board with hidden cells
+
+int failures = 0;
+
+void check(const bool ok, const string &what)
+{
+    if (!ok)
+    {
+        cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+// bitboard of the mirror image of a bitboard
+uint64_t mirror(const uint64_t bitboard)
+{
+    static const uint64_t COLUMN = (UINT64_C(1) << (Position::HEIGHT + 1)) - 1;
+    uint64_t mirrored = 0;
+    for (int col = 0; col < Position::WIDTH; col++)
+        mirrored |= (bitboard >> col * (Position::HEIGHT + 1) & COLUMN) << (Position::WIDTH - 1 - col) * (Position::HEIGHT + 1);
+    return mirrored;
+}
+
+// the same for two positions if and only if they are equal, or the mirror image of each other
+tuple<uint64_t, uint64_t, uint64_t> canonical(const Position &P)
+{
+    const auto position = make_tuple(P.GetMask(), P.GetCurrentPosition(), P.GetBlockedMask());
+    const auto mirrored = make_tuple(mirror(P.GetMask()), mirror(P.GetCurrentPosition()), mirror(P.GetBlockedMask()));
+    return min(position, mirrored);
+}
+
+// board of a position as given to Position(board) by the requests, top row first, or of its mirror image
+vector<vector<int>> board(const Position &P, const bool mirrored = false)
+{
+    const int current_player = P.nbMoves() % 2 == 0 ? 1 : 2;
+    vector<vector<int>> rows(Position::HEIGHT, vector<int>(Position::WIDTH, 0));
+    for (int row = 0; row < Position::HEIGHT; row++)
+        for (int col = 0; col < Position::WIDTH; col++)
+        {
+            const uint64_t cell = UINT64_C(1) << ((mirrored ? Position::WIDTH - 1 - col : col) * (Position::HEIGHT + 1) +
+                                                  Position::HEIGHT - 1 - row);
+            if (P.GetHiddenMask() & cell)
+                rows[row][col] = -1;
+            else if (P.GetMask() & cell)
+                rows[row][col] = P.GetCurrentPosition() & cell ? current_player : 3 - current_player;
+        }
+    return rows;
+}
+
+// a random game of a given number of moves (less if no column is free), stopped neither by a win nor by a loss
+Position randomPosition(const int nb_moves, mt19937_64 &rng)
+{
+    Position P;
+    for (int i = 0; i < nb_moves; i++)
+    {
+        vector<int> free;
+        for (int col = 0; col < Position::WIDTH; col++)
+            if (P.CanPlay(col))
+                free.push_back(col);
+        if (free.empty())
+            break;
+        P.PlayCol(free[uniform_int_distribution<size_t>(0, free.size() - 1)(rng)]);
+    }
+    return P;
+}
+
+/**
+ * A random board with hidden cells, as given by a request: at least one column has a hidden cell, at a random
+ * height, and the stones of a random game without any win are played below the hidden cells.
+ * @param: normal, set to the same stones on a normal board
+ */
+Position randomHiddenPosition(const int nb_moves, mt19937_64 &rng, Position &normal)
+{
+    vector<vector<int>> rows(Position::HEIGHT, vector<int>(Position::WIDTH, 0));
+    vector<int> free_heights(Position::WIDTH);
+    for (int &free_height : free_heights)
+        free_height = uniform_int_distribution<int>(0, Position::HEIGHT)(rng);
+    free_heights[uniform_int_distribution<int>(0, Position::WIDTH - 1)(rng)] = uniform_int_distribution<int>(0, Position::HEIGHT - 1)(rng);
+    for (int col = 0; col < Position::WIDTH; col++)
+        if (free_heights[col] < Position::HEIGHT)
+            rows[Position::HEIGHT - 1 - free_heights[col]][col] = -1;
+
+    normal = Position();
+    vector<int> heights(Position::WIDTH, 0);
+    for (int i = 0; i < nb_moves; i++)
+    {
+        vector<int> free;
+        for (int col = 0; col < Position::WIDTH; col++)
+            if (heights[col] < free_heights[col] && !normal.IsWinningMove(col))
+                free.push_back(col);
+        if (free.empty())
+            break;
+        const int col = free[uniform_int_distribution<size_t>(0, free.size() - 1)(rng)];
+        rows[Position::HEIGHT - 1 - heights[col]++][col] = i % 2 + 1;
+        normal.PlayCol(col);
+    }
+    return Position(rows);
+}
+
+// Keys of the table fit in 56 bits, deep positions included, while Key3() does not
+void testTableKeyBound(mt19937_64 &rng)
+{
+    size_t key3_overflows = 0;
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        const Position P = randomPosition(uniform_int_distribution<int>(0, Position::WIDTH * Position::HEIGHT)(rng), rng);
+        check(P.TableKey() < TABLE_KEY_LIMIT, "TableKey() of " + to_string(P.nbMoves()) + " moves outgrows 56 bits");
+        key3_overflows += P.Key3() >= TABLE_KEY_LIMIT;
+    }
+    // the reason why the table is not keyed by Key3(): the test is pointless if it never exceeds the bound
+    check(key3_overflows > 0, "no Key3() outgrew 56 bits, the positions drawn are not deep enough");
+}
+
+// Two positions share their TableKey() only if they are equal or the mirror image of each other
+void testTableKeyUnique(mt19937_64 &rng)
+{
+    map<uint64_t, tuple<uint64_t, uint64_t, uint64_t>> positions;
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        const Position P = randomPosition(uniform_int_distribution<int>(0, Position::WIDTH * Position::HEIGHT)(rng), rng);
+        const auto inserted = positions.emplace(P.TableKey(), canonical(P));
+        check(inserted.first->second == canonical(P), "two positions share the TableKey() " + to_string(P.TableKey()));
+
+        const Position mirrored(board(P, true));
+        check(mirrored.TableKey() == P.TableKey(), "a position and its mirror image have different TableKey()");
+    }
+}
+
+// Boards with hidden cells have table keys of their own, from 2^49 up: none of them is the key of a normal board
+void testHiddenTableKey(mt19937_64 &rng)
+{
+    map<uint64_t, tuple<uint64_t, uint64_t, uint64_t>> positions;
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        Position normal;
+        const Position P = randomHiddenPosition(uniform_int_distribution<int>(0, Position::WIDTH * Position::HEIGHT)(rng), rng, normal);
+        check(P.GetBlockedMask() != 0, "a board drawn with hidden cells has none");
+        check(P.TableKey() >= HIDDEN_TABLE_KEYS && P.TableKey() < TABLE_KEY_LIMIT,
+              "the TableKey() of a board with hidden cells is out of its range: " + to_string(P.TableKey()));
+        check(normal.TableKey() < HIDDEN_TABLE_KEYS, "the TableKey() of a normal board is in the range of the hidden ones");
+
+        const auto inserted = positions.emplace(P.TableKey(), canonical(P));
+        check(inserted.first->second == canonical(P), "two boards with hidden cells share the TableKey() " + to_string(P.TableKey()));
+        const Position mirrored(board(P, true));
+        check(mirrored.TableKey() == P.TableKey(), "a board with hidden cells and its mirror image have different TableKey()");
+    }
+}
+
+// A board with hidden cells neither reads nor learns the knowledge of the same stones on a normal board
+void testHiddenKnowledge(mt19937_64 &rng)
+{
+    for (int i = 0; i < 20; i++)
+    {
+        Position normal;
+        const Position P = randomHiddenPosition(12, rng, normal);
+        // the reason why the store must be skipped: the boards have the same Key3()
+        check(P.Key3() == normal.Key3(), "a board with hidden cells and its stones on a normal board have different Key3()");
+
+        Solver reference(make_shared<TranspositionTable>(1048573));
+        const int score = reference.Solve(P);
+
+        auto knowledge = make_shared<KnowledgeStore>();
+        knowledge->Learn(normal.Key3(), normal.nbMoves(), score == Position::MAX_SCORE ? score - 1 : score + 1);
+        Solver solver(make_shared<TranspositionTable>(1048573), knowledge);
+        check(solver.Solve(P) == score, "a board with hidden cells took the learned score of a normal board");
+        check(knowledge->GetStats(KnowledgeStore::LEARNED).size == 1, "the score of a board with hidden cells was learned");
+    }
+}
+
+// A table full of deep positions, the Key3() of which outgrow 56 bits, gives back the value of each of them
+void testTableExact(mt19937_64 &rng)
+{
+    TranspositionTable table(1031); // small, so that the keys probe through each other
+    map<uint64_t, uint8_t> stored;
+    while (stored.size() < 700)
+    {
+        const Position P = randomPosition(uniform_int_distribution<int>(30, Position::WIDTH * Position::HEIGHT)(rng), rng);
+        const uint8_t val = uint8_t(stored.size() % 255 + 1);
+        if (stored.emplace(P.TableKey(), val).second)
+            table.Put(P.TableKey(), val);
+    }
+    for (const auto &entry : stored)
+        check(table.Get(entry.first) == entry.second, "the table lost the value of the key " + to_string(entry.first));
+}
+
+// PutBatch() keeps the last value of each key, as a Put() of each entry in order would, with one thread or several
+void testPutBatch(mt19937_64 &rng)
+{
+    vector<pair<uint64_t, uint8_t>> entries;
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        // keys close to each other probe through the same slots, and some keys come back with another value
+        const uint64_t key = i % 5 == 4 ? entries[rng() % entries.size()].first : rng() % (TABLE_KEY_LIMIT >> (i % 2 * 40));
+        if (key)
+            entries.emplace_back(key, uint8_t(rng() % 255 + 1));
+    }
+
+    map<uint64_t, uint8_t> distinct; // the last value of each key
+    for (const auto &e : entries)
+        distinct[e.first] = e.second;
+    for (unsigned int threads : {1u, 4u})
+    {
+        TranspositionTable table(100003);
+        check(table.PutBatch(entries, threads) == distinct.size(), "PutBatch() miscounted the keys it added");
+        for (const auto &entry : distinct)
+            check(table.Get(entry.first) == entry.second, "PutBatch() on " + to_string(threads) + " threads lost the last value of a key");
+    }
+}
+
+// The scores learned by a run are read back from the journal by the next one
+void testJournalReload(mt19937_64 &rng)
+{
+    const string filename = (filesystem::temp_directory_path() / "unit_tests.journal").string();
+    filesystem::remove(filename);
+
+    map<uint64_t, pair<int, int>> scores; // score and number of moves of each key
+    {
+        KnowledgeStore knowledge;
+        knowledge.OpenJournal(filename, 0);
+        for (int i = 0; i < 200; i++)
+        {
+            const Position P = randomPosition(uniform_int_distribution<int>(0, 20)(rng), rng);
+            const int score = uniform_int_distribution<int>(Position::MIN_SCORE, Position::MAX_SCORE)(rng);
+            if (scores.emplace(P.Key3(), make_pair(score, P.nbMoves())).second) // a position has a single score
+                knowledge.Learn(P.Key3(), P.nbMoves(), score, 1);
+        }
+    }
+    {
+        KnowledgeStore knowledge;
+        knowledge.OpenJournal(filename, 0);
+        check(knowledge.GetStats(KnowledgeStore::LEARNED).size == scores.size(), "the journal was not reloaded whole");
+        for (const auto &entry : scores)
+            check(knowledge.Get(entry.first, entry.second.second) == entry.second.first - Position::MIN_SCORE + 1,
+                  "a score of the journal was lost");
+    }
+    filesystem::remove(filename);
+}
+
+int main()
+{
+    mt19937_64 rng(0x5eed);
+
+    testTableKeyBound(rng);
+    testTableKeyUnique(rng);
+    testTableExact(rng);
+    testHiddenTableKey(rng);
+    testHiddenKnowledge(rng);
+    testPutBatch(rng);
+    testJournalReload(rng);
+
+    if (failures)
+    {
+        cerr << failures << " unit test checks failed\n";
+        return 1;
+    }
+    cout << "unit tests passed\n";
+    return 0;
+}
@@ -1,76 +1,154 @@
 #include "header/Position.hpp"
 #include "header/Solver.hpp"
+#include "header/ExternalSorter.hpp"
+#include "header/OrderedPipeline.hpp"
 
-#include <unordered_set>
+#include <cstdio>
 
 using namespace std;
 
-void removeDuplicateLines(const string &file_name)
+// A line of a positions file and the key of its position, to deduplicate the file with an external sort
+struct KeyLine
+{
+    uint64_t key;
+    uint64_t line;
+};
+
+struct KeyLineKey
+{
+    uint64_t operator()(const KeyLine &k) const
+    {
+        return k.key;
+    }
+};
+
+/**
+ * Remove from a positions file (one position per line, its moves possibly followed by a score) the lines whose position
+ * appears again later in the file, transpositions and mirror images included, and the lines that are not a position.
+ * The keys are deduplicated with an external sort, so the memory used is memory_mb plus one bit per line.
+ */
+void removeDuplicateLines(const string &file_name, const size_t memory_mb = 256)
 {
     ifstream input_file(file_name);
     if (!input_file.is_open())
         return;
 
-    vector<string> unique_lines;
-    unordered_set<string> seen_lines;
-    string line;
+    ExternalSorter<KeyLine, KeyLineKey> sorter(file_name, memory_mb << 20);
+    uint64_t lines = 0;
+    for (string line; getline(input_file, line); lines++)
+    {
+        const string moves = line.substr(0, line.find(' '));
+        Position P;
+        if (!moves.empty() && P.Play(moves) == moves.size())
+            sorter.Add({P.Key3(), lines});
+    }
+    vector<bool> keep(lines, false);
+    if (!sorter.Finish([&](const KeyLine &k)
+                       { keep[k.line] = true; }))
+        return;
 
-    while (getline(input_file, line))
+    // the file is replaced once the new one is complete
+    input_file.clear();
+    input_file.seekg(0);
+    const string tmp = file_name + ".tmp";
+    ofstream output_file(tmp, ios::trunc);
+    uint64_t kept = 0, i = 0;
+    for (string line; getline(input_file, line); i++)
     {
-        if (seen_lines.insert(line).second)
+        if (keep[i])
         {
-            unique_lines.push_back(line);
+            output_file << line << "\n";
+            kept++;
         }
     }
     input_file.close();
-
-    ofstream output_file(file_name, ios::trunc);
-    if (!output_file.is_open())
-        return;
-
-    for (const auto &uniqueLine : unique_lines)
+    output_file.close();
+    if (!output_file)
     {
-        output_file << uniqueLine << "\n";
+        cerr << "Error: Can't write file " << tmp << "\n";
+        remove(tmp.c_str());
+        return;
     }
-    output_file.close();
+#ifdef _WIN32
+    remove(file_name.c_str()); // rename does not replace an existing file there
+#endif
+    rename(tmp.c_str(), file_name.c_str());
+    cout << file_name << ": " << lines - kept << " duplicated or invalid lines removed, " << kept << " left\n";
 }
 
-void genMoves(string input_file)
+/**
+ * Solve the children of the hard positions and append their scores to the warmup file.
+ * The hard positions are solved on several threads sharing the table, and the results are written in the order of the
+ * input file. A child is skipped when its score is already known: from the book, the warmup file or a child solved
+ * before (e.g. the same child of another hard position).
+ */
+void genMoves(const string &input_file, const unsigned int threads)
 {
+    auto start = chrono::steady_clock::now();
     Solver solver;
     solver.GetReady();
+    vector<unique_ptr<Solver>> workers;
+    for (unsigned int t = 0; t < threads; ++t)
+        workers.push_back(solver.Fork());
 
-    string line;
-    ofstream ofs("data/warmup.book", ios::app);
-
+    ofstream ofs(WARMUP_BOOK_PATH, ios::app);
     ifstream ifs(input_file);
     int count = 0;
-    while (getline(ifs, line))
-    {
-        count++;
-        Position P;
-        P.Play(line);
-        for (int i = 0; i <= 6; ++i)
+    atomic<int> skipped{0};
+
+    RunOrdered<string, string>(
+        threads, 16 * threads,
+        [&](string &line)
         {
-            Position P2(P);
-            if (P2.CanPlay(i))
+            return bool(getline(ifs, line));
+        },
+        [&](unsigned int worker, const string &line)
+        {
+            Position P;
+            if (P.Play(line) != line.size())
+                return string();
+            vector<Position> children;
+            vector<string> children_lines;
+            for (int i = 0; i < Position::WIDTH; ++i)
             {
+                if (!P.CanPlay(i) || P.IsWinningMove(i))
+                    continue;
+                Position P2(P);
                 P2.PlayCol(i);
-                int score = solver.Solve(P2);
-                string line2 = line;
-                line2 += to_string(i + 1);
-                ofs << line2 << " " << score << "\n";
+                if (solver.knowledge.Get(P2.Key3(), P2.nbMoves()))
+                {
+                    skipped++;
+                    continue;
+                }
+                children.push_back(P2);
+                children_lines.push_back(line + to_string(i + 1));
             }
-        }
-        ofs.flush();
-        cout << "Line " << count << " processed.\n";
-    }
+
+            vector<int> scores = workers[worker]->SolveBatch(children);
+            string results;
+            for (size_t i = 0; i < children.size(); ++i)
+                results += children_lines[i] + " " + to_string(scores[i]) + "\n";
+            return results;
+        },
+        [&](const string &results)
+        {
+            ofs << results;
+            ofs.flush();
+            count++;
+            cout << "Line " << count << " processed.\n";
+        });
+
+    chrono::duration<double> duration = chrono::steady_clock::now() - start;
+    cout << count << " hard positions processed in " << duration.count() << " s, " << skipped
+         << " children already known\n";
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    const unsigned int threads = argc > 1 ? max(1, atoi(argv[1])) : max(1u, thread::hardware_concurrency());
     removeDuplicateLines("data/hard_moves.txt");
-    genMoves("data/hard_moves.txt");
-    removeDuplicateLines("data/warmup.book");
+    genMoves("data/hard_moves.txt", threads);
+    removeDuplicateLines(WARMUP_BOOK_PATH);
+    KnowledgeStore::ConvertWarmup(WARMUP_BOOK_PATH, WARMUP_BINARY_PATH);
     return 0;
 }
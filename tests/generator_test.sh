@@ -0,0 +1,50 @@
+#!/bin/sh
+# End-to-end checks of the generator on the real output of explore: every way of scoring the moves file must give
+# the scores of calculateScore(), the root (the empty first line) included. The retrograde scoring writes the
+# lines grouped by layer, so its results are compared once sorted.
+# Run from the root of the repo: make test, or sh tests/generator_test.sh [depth] (4 by default)
+# The positions of a few moves are only quick to solve with the opening book: the one of data/ is used, or the
+# book given by BOOK (it must hold every position of at most depth moves).
+
+GENERATOR=$(pwd)/build/generator
+BOOK=${BOOK:-$(pwd)/data/depth_12_scores_7x6.book}
+DEPTH=${1:-4}
+
+if [ ! -f "$BOOK" ]; then
+    echo "generator tests skipped: $BOOK is needed to solve the explored positions"
+    exit 0
+fi
+case "$BOOK" in /*) ;; *) BOOK=$(pwd)/$BOOK ;; esac
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+mkdir data
+ln -s "$BOOK" data/depth_12_scores_7x6.book
+
+fail()
+{
+    echo "FAILED: $*"
+    exit 1
+}
+
+"$GENERATOR" "$DEPTH" > /dev/null || fail "explore $DEPTH"
+[ -z "$(head -n 1 data/moves_explored.txt)" ] || fail "explore did not write the root first"
+"$GENERATOR" data/moves_explored.txt plain.txt > /dev/null || fail "calculateScore"
+[ "$(wc -l < plain.txt)" -eq "$(wc -l < data/moves_explored.txt)" ] || fail "calculateScore did not score every position"
+
+"$GENERATOR" shard data/moves_explored.txt shard.txt 2 > /dev/null || fail "shard exited with an error"
+cmp -s plain.txt shard.txt || fail "the sharded scores differ from calculateScore"
+[ -z "$(ls shard.txt.* 2> /dev/null)" ] || fail "shard left files behind: $(ls shard.txt.*)"
+
+"$GENERATOR" retro data/moves_explored.txt retro.txt > /dev/null || fail "retro exited with an error"
+sort plain.txt > plain_sorted.txt
+sort retro.txt > retro_sorted.txt
+cmp -s plain_sorted.txt retro_sorted.txt || fail "the retrograde scores differ from calculateScore"
+[ -z "$(ls retro.txt.* 2> /dev/null)" ] || fail "retro left files behind: $(ls retro.txt.*)"
+
+: > empty.txt
+"$GENERATOR" shard empty.txt empty_shard.txt 2 > /dev/null 2>&1 && fail "shard of an empty moves file succeeded"
+"$GENERATOR" retro empty.txt empty_retro.txt > /dev/null 2>&1 && fail "retro of an empty moves file succeeded"
+
+echo "generator tests passed (depth $DEPTH)"